@@ -1,8 +1,42 @@
+#define _GNU_SOURCE /* sendmmsg() and recvmmsg() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+
+/* SIM_LIBRARY 1 builds the library declared in rdtsim.h instead of the */
+/* program: cc -DSIM_LIBRARY=1 -c goBackN.c                           */
+#ifndef SIM_LIBRARY
+#define SIM_LIBRARY 0
+#endif
+#if SIM_LIBRARY
+#include <stdarg.h>
+#include "rdtsim.h"
+static int simprintf(const char *format, ...);
+#define printf simprintf /* so a quiet sim prints nothing */
+#pragma GCC diagnostic ignored "-Wunused-function" /* what only main() calls */
+#endif
 
 /* ******************************************************************
  ALTERNATING BIT AND GO-BACK-N NETWORK EMULATOR: VERSION 1.1  J.F.Kurose
@@ -21,12 +55,128 @@
 #define BIDIRECTIONAL 1 /* change to 1 if you're doing extra credit */
                         /* and write a routine called B_output */
 
+/* the emulator runs NUM_FLOWS independent A->B connections over the same */
+/* channel.  Every flow has an A and a B entity; entity 2*f is flow f's A */
+/* side and entity 2*f+1 its B side, so all per-entity state lives in     */
+/* arrays of NUM_ENTITIES and an entity's peer is entity ^ 1.  The flows'  */
+/* A sides are spread over the first half of NUM_ENDPOINTS hosts and     */
+/* their B sides over the second half.                                    */
+#ifndef NUM_FLOWS
+#define NUM_FLOWS 1
+#endif
+#ifndef NUM_ENDPOINTS
+#define NUM_ENDPOINTS 2
+#endif
+#define NUM_ENTITIES (2 * NUM_FLOWS)
+#define ENTITY(flow, side) (2 * (flow) + (side))
+
+/* simulated time is a 64-bit count of ticks, TICKS_PER_UNIT to a time    */
+/* unit, so adding a delay to a large time never loses precision and     */
+/* events are compared as integers.  Delays are still given in (float)   */
+/* time units and converted with TICKS(); UNITS() converts back.         */
+typedef int64_t simtime;
+#define TICKS_PER_UNIT 1000000
+#define TICKS(units) ((simtime)llround((units) * (double)TICKS_PER_UNIT))
+#define UNITS(ticks) ((double)(ticks) / TICKS_PER_UNIT)
+#define SIMTIME_MAX INT64_MAX
+
+/* hot-path profiling: with PROFILE set to 1 every routine marked with   */
+/* PROFILE_SITE() counts its calls and the cycles spent in it, including  */
+/* the routines it calls, and the totals are printed after each run.      */
+/* Cycles are read from the time stamp counter on x86 and are            */
+/* nanoseconds elsewhere.  With PROFILE 0 the marks compile to nothing.   */
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+#define PROF_INSERTEVENT 0
+#define PROF_STOPTIMER 1
+#define PROF_STARTTIMER 2
+#define PROF_TOLAYER3 3
+#define PROF_CHECKSUM 4
+#define PROF_A_OUTPUT 5
+#define PROF_A_INPUT 6
+#define PROF_A_TIMER 7
+#define PROF_B_OUTPUT 8
+#define PROF_B_INPUT 9
+#define PROF_B_TIMER 10
+#define PROF_SITES 11
+
+static uint64_t profcalls[PROF_SITES];  /* calls of each site */
+static uint64_t profcycles[PROF_SITES]; /* and cycles spent in it */
+
+#if PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static inline uint64_t profilenow(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+struct profstamp
+{
+    int site;
+    uint64_t start;
+};
+
+/* charge a site for the call that is returning */
+static inline void profileexit(struct profstamp *s)
+{
+    profcalls[s->site]++;
+    profcycles[s->site] += profilenow() - s->start;
+}
+
+/* time the rest of the enclosing routine, however it returns */
+#define PROFILE_SITE(site) \
+    struct profstamp profstamp __attribute__((cleanup(profileexit))) = {site, profilenow()}
+#else
+#define PROFILE_SITE(site)
+#endif
+
+/* a piece of simulation state, as written to a snapshot: where it is */
+/* in struct simstate or struct protocolstate, and how big it is      */
+struct statevar
+{
+    size_t offset;
+    size_t size;
+};
+#define STATEVAR(type, member) {offsetof(type, member), sizeof(((type *)0)->member)}
+
+/* coalescing: with COALESCE set to 1 layer 5 packs up to COALESCE_MAX */
+/* messages into the msg it hands the sender, which goes when it is    */
+/* full or flushdelay after its first message came, and tolayer5 splits */
+/* it up again.  The payload then starts with the number of messages   */
+/* in it, as a digit.                                                   */
+#ifndef COALESCE
+#define COALESCE 0
+#endif
+#define COALESCE_MAX 8 /* up to 9 */
+#define MSG_SIZE 20
+#define PAYLOAD_SIZE (COALESCE ? 1 + COALESCE_MAX * MSG_SIZE : MSG_SIZE)
+
+/* flow control: with FLOW_CONTROL set to 1 what tolayer5 is given goes */
+/* into a receive buffer of rcvbufsize messages at each entity, which   */
+/* layer 5 drains at drainrate messages per time unit.  A message that  */
+/* finds the buffer full is lost; layer5room() tells the protocol how   */
+/* much room there is, for it to advertise to its peer.                 */
+#ifndef FLOW_CONTROL
+#define FLOW_CONTROL 0
+#endif
+
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
 /* to layer 5 via the students transport level protocol entities.         */
 struct msg
 {
-    char data[20];
+    char data[PAYLOAD_SIZE];
 };
 
 /* a packet is the data unit passed from layer 4 (students code) to layer */
@@ -37,146 +187,418 @@ struct pkt
     int seqnum;
     int acknum;
     int checksum;
-    char payload[20];
+    int window; /* receive window advertised with an ACK */
+    char payload[PAYLOAD_SIZE];
 };
 
 /********* STUDENTS WRITE THE NEXT SEVEN ROUTINES *********/
-uint32_t calculateChecksum(struct pkt packet);
-void tolayer5(int AorB, char datasent[20]);
-void tolayer3(int AorB, struct pkt packet);
-void starttimer(int AorB, float increment);
-void stoptimer(int AorB);
+static uint32_t calculateChecksum(struct pkt packet);
+static void tolayer5(int AorB, char datasent[PAYLOAD_SIZE]);
+static void tolayer3(int AorB, struct pkt packet);
+static void starttimer(int AorB, float increment);
+static void stoptimer(int AorB);
+static void layer4stats(void);
+static int layer4again(void);
+static void newprotocol(void);
+static int settimer(int AorB, float increment) __attribute__((unused));
+static void canceltimer(int id) __attribute__((unused));
+static int firedtimer(void) __attribute__((unused));
+static double goodput(void) __attribute__((unused));
+static double latencyquantile(double q) __attribute__((unused));
+static int latencymeasured(void) __attribute__((unused));
+static int layer5room(int AorB) __attribute__((unused));
 
 /*              DEFINES               */
 
 #define PACKET_BUFFER_SIZE 51
 #define WINDOW_SIZE 8
 #define TIMER_INCREMENT 17
+#ifndef RECEIVER_BUFFER
+#define RECEIVER_BUFFER 0 /* change to 1 to buffer out-of-order packets */
+#endif                    /* at the receiver instead of discarding them */
+#ifndef FEC
+#define FEC 0             /* change to 1 to send an XOR parity packet after */
+#endif
+#define FEC_GROUP 4       /* every FEC_GROUP new data packets (at most 32), */
+                          /* from which the receiver rebuilds a lost one.   */
+                          /* Each run is done again without parity, and the */
+                          /* two are compared                               */
+#define FEC_PARITY -2     /* seqnum of a parity packet; its acknum is the   */
+                          /* seqnum of the first packet of its group        */
+#define FEC_SLOTS (WINDOW_SIZE / FEC_GROUP + 2) /* groups a receiver can have open at once */
+#define BUFFER_OUT_OF_ORDER (RECEIVER_BUFFER || FEC) /* FEC needs the packets after a lost one */
+#if FEC && !defined(TIMED)
+#define TIMED 1 /* layer4stats() compares the latency with parity and without */
+#endif
 
 /*              END DEFINES           */
 
-/*              Variables A               */
+/* everything the protocol keeps between calls */
+struct protocolstate
+{
+    /*              Variables A               */
+
+    struct pkt pktBuffer[NUM_ENTITIES][PACKET_BUFFER_SIZE];
+    int pktBufferBase[NUM_ENTITIES];
+    int pktBufferNewIndex[NUM_ENTITIES];
+    int pktBufferNextSend[NUM_ENTITIES]; /* first packet not yet sent */
+    int peerWindow[NUM_ENTITIES];        /* receive window the peer last advertised */
+    long windowProbes[NUM_ENTITIES];
+    int currentSeq[NUM_ENTITIES];
 
-struct pkt pktBuffer[2][PACKET_BUFFER_SIZE];
-int pktBufferBase[2];
-int pktBufferNewIndex[2];
-int currentSeq[2];
+    /*              End Variables A           */
 
-float time = 0.000;
+    /*              Variables B               */
 
-/*              End Variables A           */
+    int expectedSeq[NUM_ENTITIES];
+    struct pkt rcvBuffer[NUM_ENTITIES][WINDOW_SIZE];
+    bool rcvBuffered[NUM_ENTITIES][WINDOW_SIZE];
 
-/*              Variables B               */
+    /*              End Variables B           */
 
-int expectedSeq[2];
+    /*              Variables FEC             */
 
-/*              End Variables B           */
+    char fecOut[NUM_ENTITIES][PAYLOAD_SIZE];           /* XOR of the group being sent */
+    int fecGroup[NUM_ENTITIES][FEC_SLOTS];             /* first seqnum of each group being received */
+    uint32_t fecHave[NUM_ENTITIES][FEC_SLOTS];         /* which of its packets have arrived */
+    bool fecParityIn[NUM_ENTITIES][FEC_SLOTS];         /* and whether its parity has */
+    char fecIn[NUM_ENTITIES][FEC_SLOTS][PAYLOAD_SIZE]; /* XOR of all those that have */
+    long packetsResent[NUM_ENTITIES], paritySent[NUM_ENTITIES], packetsRebuilt[NUM_ENTITIES];
+
+    bool fecWithout;                             /* this run leaves the parity out, to compare */
+    double fecOnGoodput, fecOnMedian, fecOnTail; /* with the run before, which didn't */
+
+    /*              End Variables FEC         */
+
+    float timeout; /* retransmission timeout, which a resumed snapshot may change */
+};
+
+/* the state of the protocol being run: built as a library, each sim */
+/* has its own                                                       */
+#if SIM_LIBRARY
+static __thread struct protocolstate *P;
+#else
+static struct protocolstate protocolstate;
+#define P (&protocolstate)
+#endif
+
+/* everything the protocol keeps between calls, saved with a snapshot.  */
+/* Each is an array indexed by entity first, so that worker processes   */
+/* can hand back the state of the entities they ran (see reportentity()) */
+static struct statevar protocolState[] = {
+    STATEVAR(struct protocolstate, pktBuffer),
+    STATEVAR(struct protocolstate, pktBufferBase),
+    STATEVAR(struct protocolstate, pktBufferNewIndex),
+    STATEVAR(struct protocolstate, pktBufferNextSend),
+    STATEVAR(struct protocolstate, peerWindow),
+    STATEVAR(struct protocolstate, windowProbes),
+    STATEVAR(struct protocolstate, currentSeq),
+    STATEVAR(struct protocolstate, expectedSeq),
+    STATEVAR(struct protocolstate, rcvBuffer),
+    STATEVAR(struct protocolstate, rcvBuffered),
+    STATEVAR(struct protocolstate, fecOut),
+    STATEVAR(struct protocolstate, fecGroup),
+    STATEVAR(struct protocolstate, fecHave),
+    STATEVAR(struct protocolstate, fecParityIn),
+    STATEVAR(struct protocolstate, fecIn),
+    STATEVAR(struct protocolstate, packetsResent),
+    STATEVAR(struct protocolstate, paritySent),
+    STATEVAR(struct protocolstate, packetsRebuilt),
+};
 
 /*              Utility               */
 
-uint32_t calculateChecksum(struct pkt packet)
+static uint32_t calculateChecksum(struct pkt packet)
 {
-    uint32_t checksum = packet.seqnum + packet.acknum;
-    for (uint8_t i = 0; i < 20; i++)
+    PROFILE_SITE(PROF_CHECKSUM);
+    uint32_t checksum = (uint32_t)packet.seqnum + (uint32_t)packet.acknum + (uint32_t)packet.window;
+    for (uint8_t i = 0; i < PAYLOAD_SIZE; i++)
     {
         checksum = checksum + (uint8_t)packet.payload[i];
     }
     return checksum;
 }
 
-int isPacketNotCorrupt(struct pkt packet){
-    return packet.checksum + calculateChecksum(packet) == -1;
+static int isPacketNotCorrupt(struct pkt packet){
+    return (uint32_t)packet.checksum + calculateChecksum(packet) == UINT32_MAX;
+}
+
+static char isAorB(int AorB) {
+    return (AorB % 2 == 0) ? 'A' : 'B';
 }
 
-char isAorB(int AorB) {
-    return (AorB == 0) ? 'A' : 'B';
+/* packets the sender may have outstanding: its own window, or less if */
+/* the peer has advertised less room */
+static int sendWindow(int AorB) {
+    return FLOW_CONTROL && P->peerWindow[AorB] < WINDOW_SIZE ? P->peerWindow[AorB] : WINDOW_SIZE;
 }
 
-void resendWindow(int AorB){
-    int sendingEndIndex = pktBufferBase[AorB]+WINDOW_SIZE < pktBufferNewIndex[AorB] ? pktBufferBase[AorB]+WINDOW_SIZE : pktBufferNewIndex[AorB];
-    for (int i = pktBufferBase[AorB]; i < sendingEndIndex; i++)
+/* resend what the peer's window allows of the unacknowledged packets, */
+/* or with its window closed, the first of them alone as a probe       */
+static void resendWindow(int AorB){
+    int end = P->pktBufferNextSend[AorB];
+
+    if (end > P->pktBufferBase[AorB] + sendWindow(AorB))
+        end = P->pktBufferBase[AorB] + sendWindow(AorB);
+    for (int i = P->pktBufferBase[AorB]; i < end; i++)
     {
+        P->packetsResent[AorB]++;
         printf("Resending Packet Seq %d\n",i);
-        tolayer3(AorB, pktBuffer[AorB][i]);
+        tolayer3(AorB, P->pktBuffer[AorB][i % PACKET_BUFFER_SIZE]);
+    }
+    if (FLOW_CONTROL && sendWindow(AorB) == 0 &&
+        P->pktBufferBase[AorB] < P->pktBufferNewIndex[AorB]) /* the peer's window is closed */
+    {
+        printf("Probing Closed Window, Seq: %d\n", P->pktBufferBase[AorB]);
+        P->windowProbes[AorB]++;
+        tolayer3(AorB, P->pktBuffer[AorB][P->pktBufferBase[AorB] % PACKET_BUFFER_SIZE]);
+        if (P->pktBufferNextSend[AorB] == P->pktBufferBase[AorB])
+            P->pktBufferNextSend[AorB]++;
     }
-    starttimer(AorB, TIMER_INCREMENT);
+    starttimer(AorB, P->timeout);
 }
 
-void sendAck(uint8_t ack,int AorB){
-    struct pkt ackPacket;
+static void sendAck(int ack,int AorB){
+    struct pkt ackPacket = {0};
     ackPacket.acknum = ack;
     ackPacket.seqnum = -1;
+    if (FLOW_CONTROL)
+        ackPacket.window = layer5room(AorB);
     ackPacket.checksum = calculateChecksum(ackPacket);
     printf("Sending Ack: %d\n", ack);
     tolayer3(AorB, ackPacket); // 1
 }
 
-void printPayload(char payload[]) {
-    for (int i = 0; i < 20; i++)
+static void printPayload(char payload[]) {
+    for (int i = 0; i < PAYLOAD_SIZE; i++)
         printf("%c", payload[i]);
     printf("\n");
 }
 
-void sendMsg(struct msg message, int AorB) {
+/* XOR src into dst, a word at a time */
+static void xorPayload(char *dst, const char *src) {
+    uint64_t a, b;
+    int i;
+
+    for (i = 0; i + 8 <= PAYLOAD_SIZE; i += 8)
+    {
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < PAYLOAD_SIZE; i++)
+        dst[i] ^= src[i];
+}
+
+/* add a packet sent for the first time to its FEC group, and send the */
+/* group's parity after its last packet */
+static void fecSend(struct pkt packet, int AorB) {
+    int index = packet.seqnum % FEC_GROUP;
+
+    if (index == 0)
+        memset(P->fecOut[AorB], 0, PAYLOAD_SIZE);
+    xorPayload(P->fecOut[AorB], packet.payload);
+    if (index == FEC_GROUP - 1)
+    {
+        struct pkt parity = {0};
+        parity.seqnum = FEC_PARITY;
+        parity.acknum = packet.seqnum - index;
+        memcpy(parity.payload, P->fecOut[AorB], PAYLOAD_SIZE);
+        parity.checksum = ~calculateChecksum(parity);
+        printf("Sending Parity Packet, Group: %d\n", parity.acknum);
+        P->paritySent[AorB]++;
+        tolayer3(AorB, parity);
+    }
+}
+
+static void checkMsg(struct pkt packet, int AorB);
+
+/* add a valid packet to its FEC group at the receiver.  Once the parity */
+/* and all but one of the group are in, the XOR of them is the missing   */
+/* one, which is rebuilt and taken as if it had arrived.  Each group     */
+/* still open within the window has a slot of its own.  Returns true if  */
+/* packet was a parity packet, which goes no further.                    */
+static bool fecReceive(struct pkt packet, int AorB) {
+    bool isParity = packet.seqnum == FEC_PARITY;
+    int first = isParity ? packet.acknum : packet.seqnum - packet.seqnum % FEC_GROUP;
+    int slot = first / FEC_GROUP % FEC_SLOTS;
+    uint32_t bit = isParity ? 0 : 1u << (packet.seqnum % FEC_GROUP);
+    uint32_t all = FEC_GROUP == 32 ? ~0u : (1u << FEC_GROUP) - 1;
+    uint32_t missing;
+
+    if (first < 0 || first + FEC_GROUP <= P->expectedSeq[AorB] || first < P->fecGroup[AorB][slot])
+        return isParity; /* too late for its group */
+    if (first > P->fecGroup[AorB][slot])
+    {
+        P->fecGroup[AorB][slot] = first;
+        P->fecHave[AorB][slot] = 0;
+        P->fecParityIn[AorB][slot] = false;
+        memset(P->fecIn[AorB][slot], 0, PAYLOAD_SIZE);
+    }
+    if (isParity ? P->fecParityIn[AorB][slot] : (P->fecHave[AorB][slot] & bit) != 0)
+        return isParity; /* seen it */
+    xorPayload(P->fecIn[AorB][slot], packet.payload);
+    if (isParity)
+        P->fecParityIn[AorB][slot] = true;
+    else
+        P->fecHave[AorB][slot] |= bit;
+    missing = all & ~P->fecHave[AorB][slot];
+    if (P->fecParityIn[AorB][slot] && missing != 0 && (missing & (missing - 1)) == 0)
+    {
+        struct pkt rebuilt = {0};
+        rebuilt.seqnum = first + __builtin_ctz(missing);
+        memcpy(rebuilt.payload, P->fecIn[AorB][slot], PAYLOAD_SIZE);
+        rebuilt.checksum = ~calculateChecksum(rebuilt);
+        P->fecHave[AorB][slot] = all;
+        P->packetsRebuilt[AorB]++;
+        printf("Rebuilt Packet From Parity, Seq: %d\n", rebuilt.seqnum);
+        checkMsg(rebuilt, AorB);
+    }
+    return isParity;
+}
+
+/* called after each run, to report anything the protocol counted */
+static void layer4stats(void) {
+    long resent = 0, parity = 0, rebuilt = 0, probes = 0;
+
+    for (int e = 0; e < NUM_ENTITIES; e++)
+    {
+        resent += P->packetsResent[e];
+        parity += P->paritySent[e];
+        rebuilt += P->packetsRebuilt[e];
+        probes += P->windowProbes[e];
+    }
+    if (FEC)
+        printf(" FEC %s:\n", P->fecWithout ? "off" : "on");
+    printf(" go-back-N resent %ld packets; sent %ld parity packets and rebuilt %ld lost packets from them\n",
+           resent, parity, rebuilt);
+    if (latencymeasured())
+        printf("   goodput %f msgs per time unit; latency median %f, 99th percentile %f\n", goodput(),
+               latencyquantile(0.5), latencyquantile(0.99));
+    else
+        printf("   goodput %f msgs per time unit\n", goodput());
+    if (FLOW_CONTROL)
+        printf("   %ld zero-window probes sent\n", probes);
+    if (FEC && !P->fecWithout)
+    {
+        P->fecOnGoodput = goodput();
+        P->fecOnMedian = latencyquantile(0.5);
+        P->fecOnTail = latencyquantile(0.99);
+    }
+    else if (FEC)
+        printf(" FEC off -> on: goodput %f -> %f, latency median %f -> %f, 99th percentile %f -> %f\n",
+               goodput(), P->fecOnGoodput, latencyquantile(0.5), P->fecOnMedian, latencyquantile(0.99), P->fecOnTail);
+}
+
+/* what the protocol's state starts with, besides zeroes */
+static void newprotocol(void) {
+    P->timeout = TIMER_INCREMENT;
+}
+
+/* called after layer4stats(); true to have the same run done again.  */
+/* With FEC each run is done again without the parity, so that the    */
+/* two can be compared.                                                */
+static int layer4again(void) {
+    P->fecWithout = FEC && !P->fecWithout;
+    return P->fecWithout;
+}
+
+/* send the cached packets up to end, or as far as the window allows */
+static void sendCached(int AorB, int end) {
+    int windowEnd = P->pktBufferBase[AorB] + sendWindow(AorB);
+
+    if (end > P->pktBufferNewIndex[AorB])
+        end = P->pktBufferNewIndex[AorB];
+    if (end > windowEnd)
+        end = windowEnd;
+    for (; P->pktBufferNextSend[AorB] < end; P->pktBufferNextSend[AorB]++)
+    {
+        int i = P->pktBufferNextSend[AorB];
+        tolayer3(AorB, P->pktBuffer[AorB][i % PACKET_BUFFER_SIZE]);
+        printf("Sending New Packet, Seq: %d\n", P->pktBuffer[AorB][i % PACKET_BUFFER_SIZE].seqnum);
+        if (FEC && !P->fecWithout)
+            fecSend(P->pktBuffer[AorB][i % PACKET_BUFFER_SIZE], AorB);
+    }
+}
+
+/* true if sendMsg() would take a message from layer 5 rather than drop it */
+static int layer4ready(int AorB) {
+    return P->pktBufferNewIndex[AorB] - P->pktBufferBase[AorB] < PACKET_BUFFER_SIZE;
+}
+
+/* packets AorB has waiting for an ACK, sent or cached */
+static int layer4window(int AorB) {
+    return P->pktBufferNewIndex[AorB] - P->pktBufferBase[AorB];
+}
+
+static void sendMsg(struct msg message, int AorB) {
     printf("Attempting to send msg from %c, msg: ", isAorB(AorB));
     printPayload(message.data);
-    if (pktBufferNewIndex == PACKET_BUFFER_SIZE - 1)
+    if (P->pktBufferNewIndex[AorB] - P->pktBufferBase[AorB] == PACKET_BUFFER_SIZE)
     {
         printf("Buffer Full, Dropping packet, msg: ");
         printPayload(message.data);
             return;
     }
 
-    struct pkt newPacket;
-    newPacket.seqnum = currentSeq[AorB];
-    currentSeq[AorB]++;
+    struct pkt newPacket = {0};
+    newPacket.seqnum = P->currentSeq[AorB];
+    P->currentSeq[AorB]++;
     memcpy(&newPacket.payload, &message, sizeof(message));
     newPacket.acknum = 0;
     newPacket.checksum = ~calculateChecksum(newPacket); 
 
-    pktBuffer[AorB][pktBufferNewIndex[AorB]] = newPacket;
-    pktBufferNewIndex[AorB]++;
+    P->pktBuffer[AorB][P->pktBufferNewIndex[AorB] % PACKET_BUFFER_SIZE] = newPacket;
+    P->pktBufferNewIndex[AorB]++;
 
-    if (pktBufferBase[AorB] + WINDOW_SIZE > pktBufferNewIndex[AorB])
+    if (P->pktBufferNextSend[AorB] == P->pktBufferNewIndex[AorB] - 1 &&
+        P->pktBufferBase[AorB] + sendWindow(AorB) >= P->pktBufferNewIndex[AorB])
     {
         printf("Window Not Full, Sending Packet, Seq: %d\n", newPacket.seqnum);
         tolayer3(AorB, newPacket);
-        if (pktBufferNewIndex[AorB] - 1 == pktBufferBase[AorB]) 
+        P->pktBufferNextSend[AorB]++;
+        if (FEC && !P->fecWithout)
+            fecSend(newPacket, AorB);
+        if (P->pktBufferNewIndex[AorB] - 1 == P->pktBufferBase[AorB]) 
         {
-            starttimer(AorB, TIMER_INCREMENT);
+            starttimer(AorB, P->timeout);
         }
     }
     else 
     {
-        printf("Window Full, Caching Packet, Seq: %d\n", pktBufferNewIndex[AorB] - 1);
+        printf("Window Full, Caching Packet, Seq: %d\n", P->pktBufferNewIndex[AorB] - 1);
+        if (FLOW_CONTROL && P->pktBufferNewIndex[AorB] - 1 == P->pktBufferBase[AorB])
+            starttimer(AorB, P->timeout); /* to probe the closed window */
     }
 }
-void checkACK(struct pkt packet, int AorB) {
+static void checkACK(struct pkt packet, int AorB) {
     printf("Packet Received At %c\n" , isAorB(AorB));
-    if (calculateChecksum(packet) == packet.checksum)
+    if (calculateChecksum(packet) == (uint32_t)packet.checksum)
     {
         printf("Packet Valid, Ack: %d\n", packet.acknum);
-        if (packet.acknum >= pktBufferBase[AorB])
+        if (FLOW_CONTROL && packet.acknum >= P->pktBufferBase[AorB] - 1)
+            P->peerWindow[AorB] = packet.window;
+        if (packet.acknum >= P->pktBufferBase[AorB])
         {
             stoptimer(AorB);
-            int oldBase = pktBufferBase[AorB];
-            pktBufferBase[AorB] = packet.acknum + 1;
-            if (pktBufferBase[AorB] + WINDOW_SIZE <= pktBufferNewIndex[AorB])
-            {
-                for (int i = pktBufferBase[AorB] + WINDOW_SIZE - (packet.acknum - oldBase); i < pktBufferBase[AorB] + WINDOW_SIZE; i++)
-                {
-                    tolayer3(AorB, pktBuffer[AorB][i]);
-                    printf("Sending New Packet, Seq: %d\n", pktBuffer[AorB][i].seqnum);
-                }
-            }
-            if (pktBufferBase[AorB] < pktBufferNewIndex[AorB])
+            P->pktBufferBase[AorB] = packet.acknum + 1;
+            if (P->pktBufferNextSend[AorB] < P->pktBufferBase[AorB])
+                P->pktBufferNextSend[AorB] = P->pktBufferBase[AorB];
+            sendCached(AorB, P->pktBufferNewIndex[AorB]); /* cached until now */
+            if (P->pktBufferBase[AorB] < P->pktBufferNewIndex[AorB])
             {
-                starttimer(AorB, TIMER_INCREMENT);
+                starttimer(AorB, P->timeout);
             }
         }
+        else if (FLOW_CONTROL && packet.acknum == P->pktBufferBase[AorB] - 1 && packet.window > 0)
+        {
+            printf("Window Update: %d\n", packet.window);
+            sendCached(AorB, P->pktBufferNewIndex[AorB]);
+        }
         else
         {
-            printf("Packet Ignored, Expecting: %d\n", pktBufferBase[AorB]);
+            printf("Packet Ignored, Expecting: %d\n", P->pktBufferBase[AorB]);
         }
     }
     else
@@ -186,21 +608,50 @@ void checkACK(struct pkt packet, int AorB) {
         resendWindow(AorB);
     }
 }
-void checkMsg(struct pkt packet, int AorB) {
+static void checkMsg(struct pkt packet, int AorB) {
     printf("Packet Received At %c\n",isAorB(AorB));
     if (isPacketNotCorrupt(packet))
     {
-        printf("Packet NOT Corrupted, Expecting: %d, Got: %d\n", expectedSeq[AorB], packet.seqnum);
-        if (packet.seqnum == expectedSeq[AorB])
+        if (FEC && fecReceive(packet, AorB))
+            return;
+        printf("Packet NOT Corrupted, Expecting: %d, Got: %d\n", P->expectedSeq[AorB], packet.seqnum);
+        if (packet.seqnum == P->expectedSeq[AorB] && FLOW_CONTROL && layer5room(AorB) <= 0)
         {
-            sendAck(expectedSeq[AorB], AorB);
+            printf("Receive Buffer Full, Dropping Packet\n");
+            sendAck(P->expectedSeq[AorB] - 1, AorB);
+        }
+        else if (packet.seqnum == P->expectedSeq[AorB])
+        {
+            if (!BUFFER_OUT_OF_ORDER)
+                sendAck(P->expectedSeq[AorB], AorB);
             printf("Sending Msg to Layer 5, Msg: ");
             printPayload(packet.payload);
-            expectedSeq[AorB]++;
+            P->expectedSeq[AorB]++;
             tolayer5(AorB, packet.payload);
+            if (BUFFER_OUT_OF_ORDER)
+            {
+                while (P->rcvBuffered[AorB][P->expectedSeq[AorB] % WINDOW_SIZE] &&
+                       (!FLOW_CONTROL || layer5room(AorB) > 0))
+                {
+                    int slot = P->expectedSeq[AorB] % WINDOW_SIZE;
+                    P->rcvBuffered[AorB][slot] = false;
+                    printf("Sending Buffered Msg to Layer 5, Msg: ");
+                    printPayload(P->rcvBuffer[AorB][slot].payload);
+                    P->expectedSeq[AorB]++;
+                    tolayer5(AorB, P->rcvBuffer[AorB][slot].payload);
+                }
+                sendAck(P->expectedSeq[AorB] - 1, AorB);
+            }
+        }
+        else if (BUFFER_OUT_OF_ORDER && packet.seqnum > P->expectedSeq[AorB] && packet.seqnum < P->expectedSeq[AorB] + WINDOW_SIZE)
+        {
+            printf("Buffering Out-of-order Packet, Seq: %d\n", packet.seqnum);
+            P->rcvBuffer[AorB][packet.seqnum % WINDOW_SIZE] = packet;
+            P->rcvBuffered[AorB][packet.seqnum % WINDOW_SIZE] = true;
+            sendAck(P->expectedSeq[AorB] - 1, AorB);
         }
         else {
-            sendAck(expectedSeq[AorB] - 1, AorB);
+            sendAck(P->expectedSeq[AorB] - 1, AorB);
         }
     }
     else
@@ -211,69 +662,99 @@ void checkMsg(struct pkt packet, int AorB) {
 /*              End Utility           */
 
 /* called from layer 5, passed the data to be sent to other side */
-void A_output(struct msg message)
+static void A_output(int flow, struct msg message)
 {
-    sendMsg(message, 0);
+    PROFILE_SITE(PROF_A_OUTPUT);
+    sendMsg(message, ENTITY(flow, 0));
 }
 
-void B_output(struct msg message) /* need be completed only for extra credit */
+static void B_output(int flow, struct msg message) /* need be completed only for extra credit */
 {
-    sendMsg(message, 1);
+    PROFILE_SITE(PROF_B_OUTPUT);
+    sendMsg(message, ENTITY(flow, 1));
 }
 
 /* called from layer 3, when a packet arrives for layer 4 */
-void A_input(struct pkt packet)
+static void A_input(int flow, struct pkt packet)
 {
+    PROFILE_SITE(PROF_A_INPUT);
     if (packet.seqnum == -1) {
-        checkACK(packet, 0);
+        checkACK(packet, ENTITY(flow, 0));
     }
     else {
-        checkMsg(packet, 0);
+        checkMsg(packet, ENTITY(flow, 0));
     }
 }
 
 /* called when A's timer goes off */
-void A_timerinterrupt(void)
+static void A_timerinterrupt(int flow)
 {
+    PROFILE_SITE(PROF_A_TIMER);
     printf("Timer A Interrupt, Resending Window\n");
-    resendWindow(0);
+    resendWindow(ENTITY(flow, 0));
 }
 
 /* the following routine will be called once (only) before any other */
 /* entity A routines are called. You can use it to do any initialization */
-void A_init(void)
+static void A_init(void)
 {
-    pktBufferBase[0] = pktBufferNewIndex[0] = currentSeq[0] = 0;
-    expectedSeq[0] = 0;
+    memset(P->packetsResent, 0, sizeof(P->packetsResent));
+    memset(P->paritySent, 0, sizeof(P->paritySent));
+    memset(P->packetsRebuilt, 0, sizeof(P->packetsRebuilt));
+    memset(P->windowProbes, 0, sizeof(P->windowProbes));
+    for (int flow = 0; flow < NUM_FLOWS; flow++)
+    {
+        int e = ENTITY(flow, 0);
+        P->pktBufferBase[e] = P->pktBufferNewIndex[e] = P->pktBufferNextSend[e] = P->currentSeq[e] = 0;
+        P->peerWindow[e] = WINDOW_SIZE;
+        P->expectedSeq[e] = 0;
+        memset(P->rcvBuffered[e], 0, sizeof(P->rcvBuffered[e]));
+        memset(P->fecGroup[e], 0, sizeof(P->fecGroup[e]));
+        memset(P->fecHave[e], 0, sizeof(P->fecHave[e]));
+        memset(P->fecParityIn[e], 0, sizeof(P->fecParityIn[e]));
+        memset(P->fecIn[e], 0, sizeof(P->fecIn[e]));
+    }
 }
 
 /* Note that with simplex transfer from a-to-B, there is no B_output() */
 
 /* called from layer 3, when a packet arrives for layer 4 at B*/
-void B_input(struct pkt packet)
+static void B_input(int flow, struct pkt packet)
 {
+    PROFILE_SITE(PROF_B_INPUT);
     if (packet.seqnum == -1) {
-        checkACK(packet, 1);
+        checkACK(packet, ENTITY(flow, 1));
     }
     else {
-        checkMsg(packet, 1);
+        checkMsg(packet, ENTITY(flow, 1));
     }
 }
 
 
 /* called when B's timer goes off */
-void B_timerinterrupt(void)
+static void B_timerinterrupt(int flow)
 {
+    PROFILE_SITE(PROF_B_TIMER);
     printf("Timer B Interrupt, Resending Window\n");
-    resendWindow(1);
+    resendWindow(ENTITY(flow, 1));
 }
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
-void B_init(void)
+static void B_init(void)
 {
-    pktBufferBase[1] = pktBufferNewIndex[1] = currentSeq[1] = 0;
-    expectedSeq[1] = 0;
+    for (int flow = 0; flow < NUM_FLOWS; flow++)
+    {
+        int e = ENTITY(flow, 1);
+        P->pktBufferBase[e] = P->pktBufferNewIndex[e] = P->pktBufferNextSend[e] = P->currentSeq[e] = 0;
+        P->peerWindow[e] = WINDOW_SIZE;
+        P->expectedSeq[e] = 0;
+        memset(P->rcvBuffered[e], 0, sizeof(P->rcvBuffered[e]));
+        memset(P->fecGroup[e], 0, sizeof(P->fecGroup[e]));
+        memset(P->fecHave[e], 0, sizeof(P->fecHave[e]));
+        memset(P->fecParityIn[e], 0, sizeof(P->fecParityIn[e]));
+        memset(P->fecIn[e], 0, sizeof(P->fecIn[e]));
+    }
 }
 
 /*****************************************************************
@@ -294,333 +775,4389 @@ to, and you defeinitely should not have to modify
 struct event
 
 {
-    float evtime;       /* event time */
+    simtime evtime;     /* event time */
     int evtype;         /* event type code */
     int eventity;       /* entity where event occurs */
     struct pkt *pktptr; /* ptr to packet (if any) assoc w/ this event */
-    struct event *prev;
-    struct event *next;
+    long order;         /* send order of the packet in its direction */
+    long evseq;         /* insertion order, breaks ties between equal times */
+    int heapindex;      /* position of this event in the event list */
+    int timerid;        /* id of a timer started with settimer(), or -1 */
+    struct event *wnext, *wprev; /* neighbours in its timing wheel slot */
+    int wlevel, wslot;  /* and which slot that is */
 };
-struct event *evlist = NULL; /* the event list */
+
+/* with TIMER_WHEEL set to 1 timer interrupts are kept out of the event  */
+/* list, on a hierarchical timing wheel: 8 levels of 256 slots, where a  */
+/* timer sits at the level of the highest byte in which its time differs */
+/* from the wheel's current time, in the slot that byte selects.  Arming */
+/* and cancelling a timer are O(1), and the wheel's earliest timer is    */
+/* found from a bitmap of occupied slots, so protocols with a timer per  */
+/* packet do not make the packet events slower.                          */
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL 0
+#endif
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS (64 / WHEEL_BITS)
 
 /* possible events: */
 #define TIMER_INTERRUPT 0
 #define FROM_LAYER5 1
 #define FROM_LAYER3 2
+#define COALESCE_TIMEOUT 3
 
 #define OFF 0
 #define ON 1
 #define A 0
 #define B 1
 
-int TRACE = 1;   /* for my debugging */
-int nsim = 0;    /* number of messages from 5 to 4 so far */
-int nsimmax = 0; /* number of msgs to generate, then stop */
 //float time = 0.000;
-float lossprob;    /* probability that a packet is dropped  */
-float corruptprob; /* probability that one bit is packet is flipped */
-float lambda;      /* arrival rate of messages from layer 5 */
-int ntolayer3;     /* number sent into layer 3 */
-int nlost;         /* number lost in media */
-int ncorrupt;      /* number corrupted by media*/
 
-main()
+/* link model: with LINK_MODEL set to 1, tolayer3() no longer uses the     */
+/* 1..10 time unit delay.  Each direction gets a bottleneck link with a    */
+/* transmission rate, a propagation delay and random jitter, fed by a      */
+/* drop-tail queue holding at most queuecap packets (plus the one being    */
+/* transmitted).  All flows share the link in each direction, which is     */
+/* indexed by the sending side (A or B).                                   */
+#ifndef LINK_MODEL
+#define LINK_MODEL 0
+#endif
+#define MAX_QUEUE_CAPACITY 1024
+
+/* channel error model: CHANNEL_MODEL picks how tolayer3() decides that a  */
+/* packet is lost or corrupted.  BERNOULLI is the original independent     */
+/* draw against lossprob and corruptprob.  GILBERT_ELLIOTT is a two-state  */
+/* (good/bad) Markov chain per direction with its own loss and corruption  */
+/* probability in each state, so errors come in bursts.  Rather than one   */
+/* random draw per packet, it draws how many packets remain until the next */
+/* state change, loss and corruption, and just counts them down.           */
+/* BIT_ERRORS loses packets like BERNOULLI but corrupts them by flipping   */
+/* each bit of the header and payload with probability ber, drawing the    */
+/* bits skipped until the next flip, across packets, so a clean packet     */
+/* costs no random numbers.  For every corrupted packet it also works out  */
+/* which of NUM_CHECKSUMS checksums would have missed the flips.           */
+#define BERNOULLI 0
+#define GILBERT_ELLIOTT 1
+#define BIT_ERRORS 2
+#ifndef CHANNEL_MODEL
+#define CHANNEL_MODEL BERNOULLI
+#endif
+#define NUM_CHECKSUMS 4
+#define PKT_BITS ((int64_t)(8 * (offsetof(struct pkt, payload) + PAYLOAD_SIZE))) /* bits that can flip */
+
+struct gechannel
 {
-    struct event *eventptr;
-    struct msg msg2give;
-    struct pkt pkt2give;
+    float leave[2];   /* per packet prob of leaving the good [0], bad [1] state */
+    float loss[2];    /* loss probability in the good, bad state */
+    float corrupt[2]; /* corruption probability in the good, bad state */
+    int bad;          /* current state */
+    int64_t tostate;   /* packets left before the next state change */
+    int64_t toloss;    /* packets left before the next loss */
+    int64_t tocorrupt; /* packets left before the next corruption */
+    int corruptnow;   /* current packet is to be corrupted */
+    long nbad;        /* number of packets sent in the bad state */
+    int64_t tobit;    /* bits to pass before the next flipped one (BIT_ERRORS) */
+};
+static char *checksumname[NUM_CHECKSUMS] = {"additive", "Internet", "Fletcher-16", "CRC-32"};
+#define SKIP_NEVER ((int64_t)1 << 62) /* a countdown that does not run out */
+
+/* channel ordering: IN_ORDER is the original medium, where a packet never */
+/* arrives before one sent earlier in the same direction.  With            */
+/* INDEPENDENT_DELAY every packet gets its own delay, so packets sent close */
+/* together can swap.  REORDER keeps the in-order channel but holds back a  */
+/* packet with probability reorderprob by up to reorderdelay time units,   */
+/* letting later packets overtake it.                                      */
+#define IN_ORDER 0
+#define INDEPENDENT_DELAY 1
+#define REORDER 2
+#ifndef CHANNEL_ORDER
+#define CHANNEL_ORDER IN_ORDER
+#endif
+
+/* replications: with REPLICATIONS above 0 the same scenario is run with   */
+/* seeds 9999, 10000, ... until the 95% confidence intervals of goodput    */
+/* and latency are narrower than CI_TARGET times their mean (after at      */
+/* least MIN_REPLICATIONS runs), or REPLICATIONS runs have been done.      */
+#ifndef REPLICATIONS
+#define REPLICATIONS 0
+#endif
+#define MIN_REPLICATIONS 5
+#define CI_TARGET 0.05
+#define SEED 9999
+
+/* when anything uses the delays (TIMED), each message carries its number */
+/* in its last 8 bytes (hex), so layer 5 can look up when it was          */
+/* generated; otherwise the payload is left as it always was.  A message  */
+/* delivered after GENRING newer ones were generated can't be looked up,  */
+/* and is counted instead.                                                */
+#define GENRING 65536
+#ifndef TIMED
+#define TIMED (REPLICATIONS > 0 || STEADY_STATE || DRAIN || SIM_LIBRARY)
+#endif
+
+/* the delays are also counted on a log scale, 8 buckets to each power */
+/* of two ticks, so quantiles come out within 12.5% in constant memory */
+#define LATENCY_BUCKETS 512
+
+/* delivery check: with VERIFY set to 1 each message also carries its   */
+/* number in its sender's stream (first 8 bytes, hex) and a hash of the  */
+/* message (next 4), and tolayer5 checks every stream as it arrives, in  */
+/* constant memory.  A gap counts as missing until the message turns up; */
+/* a bitmap of the 64 numbers below the next one expected tells a late   */
+/* message from a duplicate, and anything older is counted as stale.     */
+#ifndef VERIFY
+#define VERIFY 0
+#endif
+
+struct verifier /* the check of the stream arriving at one entity */
+{
+    uint32_t next;   /* number expected next */
+    uint64_t window; /* bit i: number next - 1 - i has arrived */
+    long inorder, late, duplicate, stale, corrupt, missing;
+};
+
+/* running mean and variance of one output over replications */
+struct runstat
+{
+    int n;
+    double mean;
+    double m2; /* sum of squared differences from the mean */
+};
+
+/* steady state: with STEADY_STATE set to 1 the messages delivered, and  */
+/* their delays, are counted over each interval of obsinterval time      */
+/* units.  After the run the warm-up is cut off, as long as asked for or */
+/* where MSER-5 puts it, and goodput and latency are estimated from      */
+/* NUM_BATCHES batch means over the rest.  Replications then use these   */
+/* estimates instead of the averages from time 0.  Sequential runs only. */
+#ifndef STEADY_STATE
+#define STEADY_STATE 0
+#endif
+#define NUM_BATCHES 20
+
+struct observation /* what happened in one interval */
+{
+    long delivered;
+    long nlatency;
+    double latencysum;
+};
+
+/* drain: with DRAIN set to 1 the run does not end when the last message */
+/* is generated.  No more are, but the run goes on until no sender has a */
+/* packet waiting for an ACK (layer4window()) or a message coalescing,   */
+/* or until draintime more time units have passed.  A flow's completion */
+/* time is when the last of its senders got its last ACK, and the delays */
+/* of the messages delivered are reported out to the 99.9th percentile.  */
+#ifndef DRAIN
+#define DRAIN 0
+#endif
+
+/* time series: with SAMPLER set to 1 the run is sampled every           */
+/* sampleinterval time units: packets sent, messages delivered and the  */
+/* goodput since the last sample, and at each entity the packets it has */
+/* waiting for an ACK (layer4window()) and its running timers.  Samples */
+/* are taken between events, so they do not disturb the run, into      */
+/* columns of SAMPLE_ROWS rows allocated once, which are written out    */
+/* whenever they fill: as CSV if the file name ends in .csv, otherwise  */
+/* as binary blocks (see flushsamples()).  Sequential runs only.        */
+#ifndef SAMPLER
+#define SAMPLER 0
+#endif
+#define SAMPLE_ROWS 4096
+
+struct samples /* a block of samples, a column per quantity */
+{
+    int nrows;
+    double time[SAMPLE_ROWS];
+    long sent[SAMPLE_ROWS];
+    long delivered[SAMPLE_ROWS];
+    float goodput[SAMPLE_ROWS];
+    int window[NUM_ENTITIES][SAMPLE_ROWS];
+    int timers[NUM_ENTITIES][SAMPLE_ROWS];
+};
+
+/* traffic sources: TRAFFIC picks how messages arrive from layer 5.        */
+/* UNIFORM is the original single stream, uniform on [0, 2*lambda] after   */
+/* the last arrival and at a random flow and side.  The others give every   */
+/* sending entity a source of its own: POISSON has exponential gaps of mean */
+/* lambda; ONOFF is Poisson during exponential on periods and silent during */
+/* exponential off periods; SATURATED hands over a new message whenever the */
+/* sender can take one, and waits for an incoming packet when it can't.     */
+/* A protocol whose timeouts keep resending a full window can then bury     */
+/* the medium and never take all nsimmax messages, so such a run gives up   */
+/* after SATURATED_STALL time units without a delivery.                     */
+/* TRACE_REPLAY reads (tick, entity) arrivals from a binary file of         */
+/* struct tracerecord, which is memory-mapped rather than read.            */
+#define UNIFORM 0
+#define POISSON 1
+#define ONOFF 2
+#define SATURATED 3
+#define TRACE_REPLAY 4
+#ifndef TRAFFIC
+#define TRAFFIC UNIFORM
+#endif
+#define SATURATED_STALL 1000 /* time units without a delivery before giving up */
+
+struct tracerecord
+{
+    int64_t tick;   /* arrival time, in ticks */
+    int32_t entity; /* entity the message is given to */
+    int32_t unused;
+};
+
+/* file transfer: with FILE_TRANSFER set to 1 layer 5 streams a real   */
+/* file instead of letters.  Every sending entity sends the whole file, */
+/* 20 bytes a message, to its peer, and is held back rather than having */
+/* messages dropped while its sender is busy.  The file is mapped, not  */
+/* read.  Every receiver keeps an Adler-32 of what it got, and the A->B */
+/* stream of flow 0 is also written to the output file.  The run ends   */
+/* when every stream has been delivered.                                */
+#ifndef FILE_TRANSFER
+#define FILE_TRANSFER 0
+#endif
+#define FILE_BUFFER (1 << 20) /* stdio buffer for the output file */
 
-    int i, j;
-    char c;
+/* snapshots: with SNAPSHOT set to 1 the run can be saved to a file when   */
+/* simulated time reaches snaptime, and a run can start from a saved file  */
+/* instead of from time 0.  The loss, corruption, arrival, link, channel   */
+/* and timeout parameters entered for the resumed run replace the saved    */
+/* ones, so one warmed-up snapshot can be forked into several variants.    */
+#ifndef SNAPSHOT
+#define SNAPSHOT 0
+#endif
+#define SNAPSHOT_MAGIC "RDTSNAP2"
+
+/* real sockets: with SOCKETS set to 1 the protocol runs over UDP on     */
+/* 127.0.0.1 instead of over the event list.  tolayer3() still applies   */
+/* the loss and corruption model and then sends the packet for real, and */
+/* layer 5 hands a new message to a sender whenever it can take one.     */
+/* Every flow is a connection, named by the id in front of each packet.  */
+/* The connections are shared out over nworkers worker processes, each  */
+/* pinned to a core and running one epoll loop.  All workers' sockets on */
+/* a side share a port with SO_REUSEPORT, and a BPF program steers each  */
+/* datagram to the worker owning its connection.  A worker keeps its     */
+/* connections' timers in a heap behind a single timerfd.  Packets are   */
+/* sent and received SOCKET_BATCH at a time with sendmmsg() and          */
+/* recvmmsg().  Time runs at usecperunit microseconds of wall clock per  */
+/* time unit.                                                            */
+#ifndef SOCKETS
+#define SOCKETS 0
+#endif
+#define SOCKET_BATCH 64
+#define SOCKET_STALL 1 /* seconds without a delivery before a worker gives up */
+#define MAX_WORKERS 64
+
+struct wirepkt /* what goes in a datagram */
+{
+    uint32_t conn; /* connection (flow) id, in network byte order */
+    struct pkt pkt;
+};
+
+struct entitystats /* and for each of its entities */
+{
+    long ndelivered, filercvd;
+    uint32_t rcvdhash;
+    uint32_t vsent;
+    struct verifier verify;
+};
+
+struct workerstats /* what a worker process reports back */
+{
+    long nsim, ndelivered, ntolayer3, nlost, ncorrupt, nsyscalls, nsenddrop;
+    long nlatency, nuntimed, nqueuedrop, nreordered, nprocessed, nwindows;
+    double latencysum, seconds;
+    simtime time;
+    long latencyhist[LATENCY_BUCKETS];
+};
+
+/* threads: with THREADS set to 1 the protocol runs in real time on three */
+/* threads instead of over the event list: one calls every A entity, one  */
+/* every B entity, and one is the medium.  tolayer3() on a side puts the  */
+/* packet on a lock-free ring to the medium, which applies the loss,      */
+/* corruption and delay models as usual and keeps the packet on the event */
+/* list until the wall clock reaches its arrival time, then puts it on a  */
+/* ring to the receiving side.  A side keeps its timers' deadlines on the */
+/* monotonic clock, and hands a sender a new message whenever it can take */
+/* one.  Time runs at usecperunit microseconds of wall clock per time     */
+/* unit.  The sim's clock belongs to the medium; the sides read the clock */
+/* into their own threadtime, which the emulator routines they call use   */
+/* instead.                                                               */
+#ifndef THREADS
+#define THREADS 0
+#endif
+#define RING_SIZE 1024  /* packets a ring holds */
+#define THREAD_POLL 50  /* most microseconds a thread sleeps between looks */
+#define THREAD_STALL 1  /* seconds without a delivery before giving up */
+#define NOW (THREADS ? threadtime : S->now)
+
+struct ringpkt
+{
+    int entity;   /* the sender on a ring to the medium, else the receiver */
+    simtime time; /* when it was sent, or when it was due to arrive */
+    struct pkt pkt;
+};
+
+struct ring /* written by one thread, read by one other */
+{
+    long head __attribute__((aligned(64))); /* on lines of their own, so */
+    long tail __attribute__((aligned(64))); /* the two threads don't share */
+    struct ringpkt slot[RING_SIZE];
+};
+
+static __thread simtime threadtime; /* the clock as the calling thread last read it */
+static __thread bool inmedium;      /* the calling thread is the medium */
+
+/* parallel simulation: with PARALLEL set to 1 every endpoint is a       */
+/* partition with its own event list, clock, random numbers and link and */
+/* channel state, and the partitions are shared out over nworkers worker */
+/* processes.  A packet for another partition goes through a lock-free   */
+/* mailbox kept for each pair of partitions.  No packet arrives sooner   */
+/* than lookahead after it is sent, so the workers advance together in   */
+/* windows (YAWNS): all events before t + lookahead, where t is the      */
+/* earliest pending event anywhere, can be simulated without waiting on  */
+/* another partition.  The results depend on the partitions but not on  */
+/* how many workers run them, so a run with one worker is the sequential */
+/* reference.  Every sending entity generates its share of nsimmax, and  */
+/* the run stops once they all have.                                     */
+#ifndef PARALLEL
+#define PARALLEL 0
+#endif
+#define MAILBOX_SIZE 4096 /* packets one partition can mail another in a window */
+
+struct mailevent /* a packet arrival mailed to another partition */
+{
+    simtime evtime;
+    int eventity;
+    long order;
+    struct pkt pkt;
+};
+
+struct mailbox /* written by one partition, read by one other */
+{
+    long head, tail;
+    struct mailevent ev[MAILBOX_SIZE];
+};
+
+struct parallelshared /* what the workers share */
+{
+    pthread_barrier_t barrier;
+    simtime next[NUM_ENDPOINTS];                       /* each partition's earliest event */
+    bool spent[NUM_ENDPOINTS];                         /* all its messages generated */
+    struct mailbox mail[NUM_ENDPOINTS][NUM_ENDPOINTS]; /* [from][to] */
+};
+
+/* live metrics: with METRICS set to 1 a background thread exports the   */
+/* run's progress in the Prometheus text format, either to a file every  */
+/* metricsperiod seconds of real time, replacing it whole so a reader    */
+/* never sees half of it, or, for a destination unix:path, as an HTTP    */
+/* reply to each scrape of that Unix socket.  The simulation only copies */
+/* its counters into metrics with relaxed atomic stores every            */
+/* METRICS_EVENTS events, so it never waits on the exporter.             */
+#ifndef METRICS
+#define METRICS 0
+#endif
+#define METRICS_EVENTS 1024 /* events between updates of metrics */
+
+struct metrics /* written by the simulation, read by the exporter */
+{
+    long events, queued, inflight, ntolayer3, delivered, nlost, ncorrupt;
+    simtime time;
+    int run;
+};
+
+/* the state of the random number generator, see jimsrand() */
+struct rng
+{
+    uint32_t r[34]; /* the last 34 values, used as a ring */
+    int i;          /* where the next value goes */
+};
+
+/* everything the emulator keeps for a run.  The program has one; built */
+/* as a library, each sim has its own, and S points at the one the      */
+/* calling thread is running.                                           */
+struct simstate
+{
+    simtime now;         /* the emulator's clock */
+    struct rng rngstate; /* see jimsrand() */
+    bool quiet;          /* print nothing, see sim_create() */
+
+    /* the event list is a binary heap ordered on event time, so inserting */
+    /* and removing an event costs O(log n) however many flows are running */
+    struct event **evlist; /* the event list */
+    int nevents;           /* events in the list */
+    int evlistsize;        /* events the list has room for */
+    long nextevseq;
+    struct event *timerevent[NUM_ENTITIES]; /* each entity's running timer */
+
+    struct event *wheel[WHEEL_LEVELS][WHEEL_SLOTS];    /* timers in each slot */
+    uint64_t wheelmap[WHEEL_LEVELS][WHEEL_SLOTS / 64]; /* slots that have any */
+    simtime wheelnow;                                  /* time of the last timer taken off the wheel */
+    int nwheel;                                        /* timers on the wheel */
+    struct event *wheelnext;                           /* the earliest of them, unless wheelstale */
+    bool wheelstale;
+
+    /* timers started with settimer() are known by an id, so an entity can */
+    /* have as many running as it likes                                     */
+    struct event **idtimers; /* running timers, by id */
+    int *freeids;            /* ids free to hand out again */
+    int nidtimers;           /* ids handed out so far */
+    int nfreeids;
+    int idtimersize; /* ids there is room for */
+    int firedtimer;  /* id of the timer being delivered, or -1 */
+
+    int TRACE;   /* for my debugging */
+    int nsim;    /* number of messages from 5 to 4 so far */
+    int nsimmax; /* number of msgs to generate, then stop */
+
+    float lossprob;    /* probability that a packet is dropped  */
+    float corruptprob; /* probability that one bit is packet is flipped */
+    float lambda;      /* arrival rate of messages from layer 5 */
+    long ntolayer3;    /* number sent into layer 3 */
+    long nlost;        /* number lost in media */
+    long ncorrupt;     /* number corrupted by media*/
+
+    float linkrate;                                 /* link rate in bytes per time unit */
+    float propdelay;                                /* propagation delay in time units */
+    float jitter;                                   /* extra delay, uniform on [0, jitter] */
+    int queuecap;                                   /* bottleneck buffer size in packets */
+    simtime linkfree[2];                            /* time each link finishes its current transmission */
+    simtime queuedepart[2][MAX_QUEUE_CAPACITY + 1]; /* departure times of queued packets */
+    int queuehead[2];
+    int queuelen[2];
+    long nqueuedrop; /* number dropped at a full bottleneck queue */
+
+    struct gechannel channel[2];  /* indexed by sending side */
+    double ber;                   /* bit error rate (BIT_ERRORS) */
+    long nflipped;                /* bits flipped */
+    long nescaped[NUM_CHECKSUMS]; /* corrupted packets each checksum missed */
+
+    float reorderprob;                 /* probability that a packet is held back */
+    float reorderdelay;                /* maximum extra delay of a held back packet */
+    simtime lastarrival[NUM_ENTITIES]; /* latest in-order arrival scheduled from each entity */
+    long sendorder[NUM_ENTITIES];      /* packets each entity put on the channel */
+    long lastdelivered[NUM_ENTITIES];  /* highest send order delivered from each entity */
+    long nreordered;                   /* number delivered after a packet sent later */
+    int ndelivered[NUM_ENTITIES];      /* messages each entity passed up to layer 5 */
+
+    simtime gentime[GENRING]; /* generation time of recent messages by number */
+    double latencysum;        /* total delay of messages delivered to layer 5 */
+    int nlatency;             /* messages the delay was measured for */
+    long nuntimed;            /* and delivered too late to look up */
+
+    long latencyhist[LATENCY_BUCKETS];
+
+    uint32_t vsent[NUM_ENTITIES];         /* messages each entity has numbered */
+    struct verifier verify[NUM_ENTITIES]; /* check of the stream arriving at each */
+
+    struct msg pending[NUM_ENTITIES];       /* messages coalesced so far */
+    int npending[NUM_ENTITIES];             /* and how many */
+    struct event *flushevent[NUM_ENTITIES]; /* when they go anyway */
+    float flushdelay;                       /* how long the first one waits */
+
+    int rcvbufsize;                   /* messages a receive buffer holds */
+    float drainrate;                  /* messages layer 5 takes out per time unit */
+    double rcvfill[NUM_ENTITIES];     /* messages in each buffer */
+    simtime rcvdrained[NUM_ENTITIES]; /* when it was last drained */
+    long nrcvoverflow;                /* messages that found their buffer full */
+
+    struct runstat goodputstat, latencystat;
+
+    float warmup;                        /* warm-up to cut off, < 0 for MSER-5 */
+    float obsinterval;                   /* length of an observation interval */
+    simtime obsticks;                    /* and in ticks */
+    struct observation *obs;             /* the intervals of this run */
+    long obssize;                        /* intervals there is room for */
+    double steadygoodput, steadylatency; /* estimates from the last run */
+
+    float draintime;                 /* longest drain, 0 for no limit */
+    simtime drainstart;              /* when the last message was generated, -1 before */
+    simtime lastacked[NUM_ENTITIES]; /* when each sender last got its window empty */
+    simtime latencymax;              /* longest delay measured */
+    bool drained;                    /* the drain ended with nothing waiting */
+
+    struct samples *samples;
+    float sampleinterval; /* time units between samples */
+    simtime sampleticks;  /* and in ticks */
+    simtime nextsample;   /* when the next sample is due */
+    long sampledelivered; /* messages delivered at the last sample */
+    char samplefile[256];
+    FILE *samplef;
+    long nsamples; /* samples written */
+
+    float ontime, offtime;         /* mean on and off period of ONOFF sources */
+    simtime onuntil[NUM_ENTITIES]; /* end of each ONOFF source's on period */
+    bool parked[NUM_ENTITIES];     /* SATURATED source waiting for its sender */
+    simtime lastdelivery;          /* when a message last reached layer 5 */
+    struct tracerecord *tracedata; /* the mapped trace */
+    long tracelen;                 /* records in the trace */
+    long tracenext;                /* next record to replay */
+    char tracefile[256];           /* name of the arrival trace */
+
+    char sendfile[256];      /* file to send */
+    char recvfile[256];      /* where flow 0's A->B copy goes */
+    unsigned char *filedata; /* the mapped file */
+    long filesize;           /* its length in bytes */
+    uint32_t filehash;       /* its Adler-32 */
+    FILE *outfile;
+    long filesent[NUM_ENTITIES];     /* bytes each entity has sent */
+    long filercvd[NUM_ENTITIES];     /* bytes each entity has received */
+    uint32_t rcvdhash[NUM_ENTITIES]; /* Adler-32 of what it received */
+    int nstreams;                    /* streams still being received */
+    struct timespec filestart;       /* wall clock at the start of the run */
+
+    char resumefile[256]; /* snapshot to start from, "-" for none */
+    char snapfile[256];   /* where to save the snapshot */
+    simtime snaptime;     /* when to save it, 0 for never */
+
+    float usecperunit;                   /* wall clock microseconds per time unit */
+    int nworkers;                        /* worker processes */
+    int worker;                          /* the one this process is */
+    int sockfd[MAX_WORKERS][2];          /* each worker's socket on each side */
+    struct sockaddr_in sockaddr[2];      /* the port each side's sockets share */
+    struct timespec socketstart;         /* wall clock at time 0 */
+    int epfd;                            /* the worker's epoll instance */
+    int timerfd;                         /* goes off for the soonest timer */
+    simtime timerset;                    /* when timerfd is set for, 0 if not */
+    simtime timerdeadline[NUM_ENTITIES]; /* when each running timer goes off */
+    int timerheap[NUM_ENTITIES];         /* running timers, soonest first */
+    int timerpos[NUM_ENTITIES];          /* place in timerheap, -1 if stopped */
+    int ntimers;
+    long budget;                              /* messages this worker generates */
+    long flowbudget[NUM_FLOWS];               /* each flow's equal share, still to go */
+    struct wirepkt outbatch[2][SOCKET_BATCH]; /* packets waiting for sendmmsg() */
+    int noutbatch[2];
+    long nsyscalls;                       /* socket and timer system calls made */
+    long nsenddrop;                       /* packets the kernel would not take */
+    long nsockdelivered;                  /* messages this worker delivered */
+    double wallseconds;                   /* length of the last socket run */
+    struct workerstats *workerstats;      /* shared with the workers */
+    struct entitystats *entitystats;      /* per entity, shared likewise */
+    struct protocolstate *workerprotocol; /* each entity's protocol state, likewise */
+
+    struct ring tomedium[2], frommedium[2]; /* by side */
+
+    struct timespec threadstart;          /* wall clock at time 0 */
+    simtime sidenext[2];                  /* each side's soonest timer, or earlier */
+    simtime sidetransit[2];               /* delay the medium gives each side's packets, */
+    simtime sidelag[2];                   /* and how late each side takes its own, smoothed */
+    long sidebudget[2], sidegenerated[2]; /* messages each side is to generate, has */
+    long sidedelivered[2];                /* and has delivered, for the main thread */
+    long nringdrop[2];                    /* packets a full ring to the medium refused */
+    bool threadsstop;                     /* set by the main thread when done */
+    double threadcpu[3];                  /* CPU seconds of A, B and the medium */
+
+    struct parallelshared *shared;
+    int partition;                 /* the partition being simulated */
+    char *partsave[NUM_ENDPOINTS]; /* each partition's copy of partitionState */
+    simtime lookahead;             /* least delay of any packet */
+    long nwindows;                 /* windows simulated */
+    long nprocessed;               /* events simulated */
+    long eventlimit;               /* where simulate() stops for sim_run() */
+    bool simdone;                  /* all nsimmax messages generated */
+    int runseed;                   /* seed of the current run */
+
+    struct metrics metrics;
+    char metricsdest[256]; /* file to write, or unix:path of a socket to serve */
+    float metricsperiod;   /* seconds of real time between exports */
+    pthread_t metricsid;
+    bool metricsstop; /* set by the simulation when it is done */
+    long nexports;    /* metrics written out */
+    long ninflight;   /* packets in the medium */
+};
+
+#if SIM_LIBRARY
+static __thread struct simstate *S;
+#else
+static struct simstate simstate;
+#define S (&simstate)
+#endif
+
+/* the emulator's routines, in the order they are defined below */
+static void simulate(simtime until);
+static void newsim(void);
+static void init(void);
+static void startrun(int seed);
+static void givemessage(int entity);
+static void passmsg(int entity, struct msg msg);
+static int acceptsmsg(int entity);
+static void coalesce(int entity, char data[20]);
+static void flushmsgs(int entity);
+static void drainbuffer(int AorB);
+static void printcoalescestats(void);
+static void puthex(char *s, unsigned long v, int n);
+static void stampmsg(char data[20], int n);
+static unsigned msghash(int entity, char data[20]);
+static void tagmsg(int entity, char data[20]);
+static long hexfield(char *s, int n);
+static void verifymsg(int AorB, char data[20]);
+static void printverify(void);
+static int latencybucket(simtime t);
+static simtime bucketstart(int b);
+static void addsample(struct runstat *st, double x);
+static double halfwidth(struct runstat *st);
+static struct observation *interval(long k);
+static long mser5(long n);
+static void printsteadystate(void);
+static int replicationdone(int n);
+static int draindone(void);
+static void printdrainstats(void);
+static void printflowstats(void);
+static int flowendpoint(int entity);
+static int64_t geometricskip(double p);
+static void enterstate(struct gechannel *ch, int bad);
+static int channelloses(int AorB);
+static int channelcorrupts(int AorB);
+static void seedrandom(unsigned seed);
+static int nextrandom(void);
+static float jimsrand(void);
+static void printprofile(void);
+static int statesize(void);
+static void snapevent(FILE *f, struct event *p);
+static void snapshot(char *name);
+static void restore(char *name);
+static uint32_t adler32(uint32_t hash, unsigned char *data, long n);
+static void openfiles(void);
+static void startfiles(void);
+static void filechunk(int entity, char data[20]);
+static void filereceive(int AorB, char data[20]);
+static void printfilestats(void);
+static void mapstats(void);
+static void runworkers(void (*body)(void));
+static void reportworker(long delivered, struct timespec *start);
+static void reportentity(int e);
+static void collectstats(void);
+static void sockettime(void);
+static void timersift(int i);
+static void timerremove(int AorB);
+static void armtimer(int AorB, float increment);
+static void timerrearm(void);
+static void socketflush(int side);
+static void socketsend(int AorB, struct pkt *packet);
+static void socketfeed(int e);
+static void socketreceive(int side);
+static void sockettimers(void);
+static void socketworker(void);
+static void socketopen(int side);
+static void socketrun(void);
+static void printsocketstats(void);
+static bool ringput(struct ring *r, int entity, struct pkt *pkt, simtime time);
+static struct ringpkt *ringpeek(struct ring *r);
+static void ringpop(struct ring *r);
+static simtime threadclock(void);
+static void threadwait(simtime deadline);
+static void threadtimer(int AorB, float increment);
+static void threadtimers(int side);
+static void threadfeed(int e);
+static void *sidethread(void *arg);
+static void *mediumthread(void *arg __attribute__((unused)));
+static void threadrun(void);
+static void printthreadstats(void);
+static void swapin(int p);
+static void swapout(int p);
+static int partitionbudget(int p);
+static void startpartition(int p, int budget);
+static void mailsend(struct event *evptr);
+static void mailreceive(void);
+static void parallelworker(void);
+static void parallelrun(void);
+static void printparallelstats(void);
+static void opensamples(void);
+static void flushsamples(void);
+static void takesample(void);
+static void publishmetrics(int run);
+static void printmetric(FILE *f, char *name, char *type, char *help, double value);
+static void writemetrics(FILE *f);
+static void exportfile(void);
+static void *metricsthread(void *arg);
+static void startmetrics(void);
+static void stopmetrics(void);
+static double exponential(float mean);
+static void maptrace(char *name);
+static void generate_next_arrival(int entity);
+static void newevlist(void);
+static int evbefore(struct event *p, struct event *q);
+static void evplace(struct event *p, int i);
+static void evsift(int i);
+static int wheelslot(int level, int slot);
+static void wheeladd(struct event *p);
+static void wheelremove(struct event *p);
+static struct event *wheelpeek(void);
+static void wheeladvance(struct event *p);
+static void insertevent(struct event *p);
+static void addevent(struct event *p);
+static void removeevent(struct event *p);
+static struct event *nextevent(void);
+static struct event *peekevent(void);
+static void printevlist(void) __attribute__((unused)); /* for debugging */
+static void growtimers(void);
+static void releasetimer(int id);
+static simtime linkenqueue(int AorB);
+static uint32_t checksumof(int alg, struct pkt *p);
+static void flipbits(int AorB, struct pkt *p);
+static void printescapes(void);
+static void corruptpacket(int AorB, struct pkt *mypktptr);
+static void atomicadd(double *sum, double x);
+static void delivermsg(int AorB, char datasent[20]);
+
+#if !SIM_LIBRARY
+int main(void)
+{
+    int rep, again = false;
 
     init();
-    A_init();
-    B_init();
+    for (rep = 0;; rep++)
+    {
+        if (rep > 0 || again)
+            startrun(SEED + rep);
+        A_init();
+        B_init();
+        if (SNAPSHOT && rep == 0 && strcmp(S->resumefile, "-") != 0)
+            restore(S->resumefile);
+        if (SOCKETS)
+            socketrun();
+        else if (PARALLEL)
+            parallelrun();
+        else if (THREADS)
+            threadrun();
+        else
+            simulate(SIMTIME_MAX);
+        if (METRICS)
+            publishmetrics(rep);
+        if (SAMPLER)
+            flushsamples();
+        printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n", UNITS(S->now), S->nsim);
+        if (S->nuntimed > 0)
+            printf(" %ld msgs delivered too late to time, with more than %d newer ones generated\n", S->nuntimed,
+                   GENRING);
+        if (LINK_MODEL)
+            printf(" %ld packets sent into layer3, %ld dropped at the bottleneck queue\n", S->ntolayer3, S->nqueuedrop);
+        if (CHANNEL_MODEL == GILBERT_ELLIOTT)
+            printf(" %ld lost, %ld corrupted; %ld packets A->B and %ld B->A sent in the bad state\n",
+                   S->nlost, S->ncorrupt, S->channel[A].nbad, S->channel[B].nbad);
+        if (CHANNEL_MODEL == BIT_ERRORS)
+            printescapes();
+        if (CHANNEL_ORDER != IN_ORDER)
+            printf(" %ld packets sent into layer3, %ld delivered out of order\n", S->ntolayer3, S->nreordered);
+        if (NUM_FLOWS > 1)
+            printflowstats();
+        if (SOCKETS)
+            printsocketstats();
+        if (THREADS)
+            printthreadstats();
+        if (FILE_TRANSFER)
+            printfilestats();
+        else if (VERIFY)
+            printverify();
+        if (PARALLEL)
+            printparallelstats();
+        if (STEADY_STATE)
+            printsteadystate();
+        if (DRAIN)
+            printdrainstats();
+        if (COALESCE)
+            printcoalescestats();
+        if (FLOW_CONTROL)
+            printf(" receive buffers of %d msgs drained at %f msgs per time unit; %ld msgs found theirs full\n",
+                   S->rcvbufsize, S->drainrate, S->nrcvoverflow);
+        if (PROFILE)
+            printprofile();
+        layer4stats();
+        if ((again = layer4again())) /* the protocol wants this run again */
+            rep--;
+        else if (REPLICATIONS == 0 || replicationdone(rep + 1))
+            break;
+    }
+    if (METRICS)
+        stopmetrics();
+    if (SAMPLER)
+    {
+        fclose(S->samplef);
+        printf(" %ld samples written to %s\n", S->nsamples, S->samplefile);
+    }
+    return 0;
+}
+#endif
+
+/* run the current scenario until nsimmax messages have been generated, */
+/* or until the next event is not before until                          */
+static void simulate(simtime until)
+{
+    struct event *eventptr;
+    struct pkt pkt2give;
+
+    int i, j, busy;
 
     while (1)
     {
-        eventptr = evlist; /* get next event to simulate */
+        if (SIM_LIBRARY && S->nprocessed >= S->eventlimit)
+            return;
+        if (SNAPSHOT && S->snaptime > 0 && peekevent() != NULL && peekevent()->evtime >= S->snaptime)
+        {
+            snapshot(S->snapfile);
+            S->snaptime = 0;
+        }
+        if (peekevent() != NULL && peekevent()->evtime >= until)
+            return;
+        eventptr = nextevent(); /* get next event to simulate */
         if (eventptr == NULL)
-            goto terminate;
-        evlist = evlist->next; /* remove this event from event list */
-        if (evlist != NULL)
-            evlist->prev = NULL;
-        if (TRACE >= 2)
+            return;
+        while (SAMPLER && S->nextsample <= eventptr->evtime)
+            takesample();
+        S->nprocessed++;
+        if (METRICS && S->nprocessed % METRICS_EVENTS == 0)
+            publishmetrics(S->runseed - SEED);
+        if (S->TRACE >= 2)
         {
-            printf("\nEVENT time: %f,", eventptr->evtime);
+            printf("\nEVENT time: %f,", UNITS(eventptr->evtime));
             printf("  type: %d", eventptr->evtype);
             if (eventptr->evtype == 0)
                 printf(", timerinterrupt  ");
             else if (eventptr->evtype == 1)
                 printf(", fromlayer5 ");
-            else
+            else if (eventptr->evtype == 2)
                 printf(", fromlayer3 ");
+            else
+                printf(", coalesce timeout ");
             printf(" entity: %d\n", eventptr->eventity);
         }
-        time = eventptr->evtime; /* update time to next event time */
-        if (nsim == nsimmax)
+        S->now = eventptr->evtime; /* update time to next event time */
+        if (DRAIN && eventptr->evtype == FROM_LAYER5 && S->nsim == S->nsimmax) /* draining */
+        {
+            free(eventptr);
+            continue;
+        }
+        if (!DRAIN && !PARALLEL && (FILE_TRANSFER ? S->nstreams == 0 : S->nsim == S->nsimmax))
+        {
+            if (eventptr->evtype == FROM_LAYER3)
+                free(eventptr->pktptr);
+            free(eventptr);
+            S->simdone = true;
             break; /* all done with simulation */
+        }
+        if (TRAFFIC == SATURATED && !PARALLEL && S->now - S->lastdelivery > TICKS(SATURATED_STALL))
+        {
+            printf(" No delivery for %d time units, giving up\n", SATURATED_STALL);
+            if (eventptr->evtype == FROM_LAYER3)
+                free(eventptr->pktptr);
+            free(eventptr);
+            S->simdone = true;
+            break;
+        }
         if (eventptr->evtype == FROM_LAYER5)
         {
-            generate_next_arrival(); /* set up future arrival */
-            /* fill in msg to give with string of same letter */
-            j = nsim % 26;
-            for (i = 0; i < 20; i++)
-                msg2give.data[i] = 97 + j;
-            if (TRACE > 2)
+            if (PARALLEL && S->nsim == S->nsimmax) /* this partition's share is generated */
             {
-                printf("          MAINLOOP: data given to student: ");
-                for (i = 0; i < 20; i++)
-                    printf("%c", msg2give.data[i]);
-                printf("\n");
+                free(eventptr);
+                continue;
             }
-            nsim++;
-            if (eventptr->eventity == A)
-                A_output(msg2give);
-            else
-                B_output(msg2give);
+            if (FILE_TRANSFER && S->filesent[eventptr->eventity] == S->filesize)
+            {
+                if (TRAFFIC == UNIFORM && S->nsim < S->nsimmax)
+                    generate_next_arrival(eventptr->eventity); /* it may pick another */
+                free(eventptr);
+                continue;
+            }
+            if ((TRAFFIC == SATURATED || FILE_TRANSFER) && !acceptsmsg(eventptr->eventity))
+            {
+                S->parked[eventptr->eventity] = true; /* until a packet arrives */
+                free(eventptr);
+                continue;
+            }
+            generate_next_arrival(eventptr->eventity); /* set up future arrival */
+            givemessage(eventptr->eventity);
         }
         else if (eventptr->evtype == FROM_LAYER3)
         {
+            S->ninflight--;
+            busy = DRAIN && layer4window(eventptr->eventity) > 0;
+            j = eventptr->eventity ^ 1; /* entity that sent it */
+            if (eventptr->order < S->lastdelivered[j])
+                S->nreordered++;
+            else
+                S->lastdelivered[j] = eventptr->order;
             pkt2give.seqnum = eventptr->pktptr->seqnum;
             pkt2give.acknum = eventptr->pktptr->acknum;
             pkt2give.checksum = eventptr->pktptr->checksum;
-            for (i = 0; i < 20; i++)
+            pkt2give.window = eventptr->pktptr->window;
+            for (i = 0; i < PAYLOAD_SIZE; i++)
                 pkt2give.payload[i] = eventptr->pktptr->payload[i];
-            if (eventptr->eventity == A) /* deliver packet by calling */
-                A_input(pkt2give);       /* appropriate entity */
+            if (eventptr->eventity % 2 == A)                 /* deliver packet by calling */
+                A_input(eventptr->eventity / 2, pkt2give); /* appropriate entity */
             else
-                B_input(pkt2give);
+                B_input(eventptr->eventity / 2, pkt2give);
             free(eventptr->pktptr); /* free the memory for packet */
+            if (busy && layer4window(eventptr->eventity) == 0)
+                S->lastacked[eventptr->eventity] = S->now;
+            if (COALESCE && S->npending[eventptr->eventity] > 0 && S->flushevent[eventptr->eventity] == NULL &&
+                layer4ready(eventptr->eventity))
+                flushmsgs(eventptr->eventity); /* held until the sender could take it */
+            if ((TRAFFIC == SATURATED || FILE_TRANSFER) && S->parked[eventptr->eventity] &&
+                acceptsmsg(eventptr->eventity))
+            {
+                S->parked[eventptr->eventity] = false;
+                generate_next_arrival(eventptr->eventity);
+            }
         }
         else if (eventptr->evtype == TIMER_INTERRUPT)
         {
-            if (eventptr->eventity == A)
-                A_timerinterrupt();
+            S->firedtimer = eventptr->timerid;
+            if (S->firedtimer >= 0)
+                releasetimer(S->firedtimer);
+            else
+                S->timerevent[eventptr->eventity] = NULL;
+            if (eventptr->eventity % 2 == A)
+                A_timerinterrupt(eventptr->eventity / 2);
             else
-                B_timerinterrupt();
+                B_timerinterrupt(eventptr->eventity / 2);
+            S->firedtimer = -1;
+        }
+        else if (eventptr->evtype == COALESCE_TIMEOUT)
+        {
+            S->flushevent[eventptr->eventity] = NULL;
+            flushmsgs(eventptr->eventity);
         }
         else
         {
             printf("INTERNAL PANIC: unknown event type \n");
         }
         free(eventptr);
+        if (DRAIN && S->drainstart >= 0 && (draindone() || (S->draintime > 0 && S->now - S->drainstart >= TICKS(S->draintime))))
+        {
+            S->simdone = true;
+            break; /* drained, or given up on */
+        }
     }
+}
 
-terminate:
-    printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n", time, nsim);
+/* what a sim starts with, before init() or sim_create() sets it up, */
+/* besides zeroes                                                    */
+static void newsim(void)
+{
+    S->TRACE = 1;
+    S->firedtimer = -1;
+    S->eventlimit = LONG_MAX;
+    newprotocol();
 }
 
-init(void) /* initialize the simulator */
+static void init(void) /* initialize the simulator */
 {
     int i;
-    float sum, avg;
-    float jimsrand();
+    float sum;
 
+    newsim();
     printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
     printf("Enter the number of messages to simulate: ");
-    scanf("%d", &nsimmax);
+    scanf("%d", &S->nsimmax);
     printf("Enter  packet loss probability [enter 0.0 for no loss]:");
-    scanf("%f", &lossprob);
+    scanf("%f", &S->lossprob);
     printf("Enter packet corruption probability [0.0 for no corruption]:");
-    scanf("%f", &corruptprob);
+    scanf("%f", &S->corruptprob);
     printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
-    scanf("%f", &lambda);
+    scanf("%f", &S->lambda);
     printf("Enter TRACE:");
-    scanf("%d", &TRACE);
-
-    srand(9999); /* init random number generator */
-    sum = 0.0;   /* test random number generator for students */
-    for (i = 0; i < 1000; i++)
-        sum = sum + jimsrand(); /* jimsrand() should be uniform in [0,1] */
-    avg = sum / 1000.0;
-    if (avg < 0.25 || avg > 0.75)
+    scanf("%d", &S->TRACE);
+    if (LINK_MODEL)
     {
-        printf("It is likely that random number generation on your machine\n");
-        printf("is different from what this emulator expects.  Please take\n");
-        printf("a look at the routine jimsrand() in the emulator code. Sorry. \n");
-        exit(0);
+        printf("Enter link rate in bytes per time unit [ > 0.0]:");
+        scanf("%f", &S->linkrate);
+        printf("Enter propagation delay:");
+        scanf("%f", &S->propdelay);
+        printf("Enter delay jitter [0.0 for none]:");
+        scanf("%f", &S->jitter);
+        printf("Enter bottleneck queue capacity in packets [0 - %d]:", MAX_QUEUE_CAPACITY);
+        scanf("%d", &S->queuecap);
+        if (S->queuecap < 0)
+            S->queuecap = 0;
+        if (S->queuecap > MAX_QUEUE_CAPACITY)
+            S->queuecap = MAX_QUEUE_CAPACITY;
     }
-
-    ntolayer3 = 0;
-    nlost = 0;
-    ncorrupt = 0;
-
-    time = 0.0;              /* initialize time to 0.0 */
-    generate_next_arrival(); /* initialize event list */
-}
-
-/****************************************************************************/
-/* jimsrand(): return a float in range [0,1].  The routine below is used to */
-/* isolate all random number generation in one location.  We assume that the*/
-/* system-supplied rand() function return an int in therange [0,mmm]        */
-/****************************************************************************/
-float jimsrand(void)
-{
-    double mmm = (double)RAND_MAX; //2147483647;   /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
-    float x;                       /* individual students may need to change mmm */
-    x = rand() / mmm;              /* x should be uniform in [0,1] */
+    if (CHANNEL_ORDER == REORDER)
+    {
+        printf("Enter reorder probability:");
+        scanf("%f", &S->reorderprob);
+        printf("Enter maximum reorder displacement in time units:");
+        scanf("%f", &S->reorderdelay);
+    }
+    if (CHANNEL_MODEL == BIT_ERRORS)
+    {
+        if (SOCKETS || PARALLEL)
+        {
+            printf("BIT_ERRORS does not work with SOCKETS or PARALLEL\n");
+            exit(1);
+        }
+        printf("Enter bit error rate [instead of the corruption probability]:");
+        scanf("%lf", &S->ber);
+    }
+    if (CHANNEL_MODEL == GILBERT_ELLIOTT)
+        for (i = 0; i < 2; i++)
+        {
+            printf("Enter %s Gilbert-Elliott p(good->bad) p(bad->good):", i == A ? "A->B" : "B->A");
+            scanf("%f %f", &S->channel[i].leave[0], &S->channel[i].leave[1]);
+            printf("Enter %s loss probability in good and bad state:", i == A ? "A->B" : "B->A");
+            scanf("%f %f", &S->channel[i].loss[0], &S->channel[i].loss[1]);
+            printf("Enter %s corruption probability in good and bad state:", i == A ? "A->B" : "B->A");
+            scanf("%f %f", &S->channel[i].corrupt[0], &S->channel[i].corrupt[1]);
+        }
+    if (TRAFFIC == ONOFF)
+    {
+        printf("Enter mean on period:");
+        scanf("%f", &S->ontime);
+        printf("Enter mean off period:");
+        scanf("%f", &S->offtime);
+    }
+    if (TRAFFIC == TRACE_REPLAY)
+    {
+        printf("Enter arrival trace file:");
+        scanf("%255s", S->tracefile);
+        maptrace(S->tracefile);
+    }
+    if (FILE_TRANSFER)
+    {
+        printf("Enter file to send:");
+        scanf("%255s", S->sendfile);
+        printf("Enter file to write what B receives to:");
+        scanf("%255s", S->recvfile);
+        openfiles();
+    }
+    if (SOCKETS)
+    {
+        printf("Enter microseconds of real time per time unit [ > 0.0]:");
+        scanf("%f", &S->usecperunit);
+        printf("Enter number of worker processes [1 - %d]:", MAX_WORKERS);
+        scanf("%d", &S->nworkers);
+        if (S->nworkers < 1)
+            S->nworkers = 1;
+        if (S->nworkers > MAX_WORKERS)
+            S->nworkers = MAX_WORKERS;
+        if (S->nworkers > NUM_FLOWS)
+            S->nworkers = NUM_FLOWS;
+    }
+    if (THREADS)
+    {
+        if (SOCKETS || PARALLEL || SNAPSHOT || PROFILE || COALESCE || FLOW_CONTROL || FILE_TRANSFER || STEADY_STATE ||
+            SAMPLER || METRICS)
+        {
+            printf("THREADS does not work with SOCKETS, PARALLEL, SNAPSHOT, PROFILE, COALESCE, FLOW_CONTROL,\n"
+                   "FILE_TRANSFER, STEADY_STATE, SAMPLER or METRICS\n");
+            exit(1);
+        }
+        printf("Enter microseconds of real time per time unit [ > 0.0]:");
+        scanf("%f", &S->usecperunit);
+    }
+    if (PARALLEL)
+    {
+        if (SOCKETS || FILE_TRANSFER || SNAPSHOT || TRAFFIC == TRACE_REPLAY)
+        {
+            printf("PARALLEL does not work with SOCKETS, FILE_TRANSFER, SNAPSHOT or TRACE_REPLAY\n");
+            exit(1);
+        }
+        printf("Enter number of worker processes [1 - %d]:", MAX_WORKERS);
+        scanf("%d", &S->nworkers);
+        if (S->nworkers < 1)
+            S->nworkers = 1;
+        if (S->nworkers > MAX_WORKERS)
+            S->nworkers = MAX_WORKERS;
+        if (S->nworkers > NUM_ENDPOINTS)
+            S->nworkers = NUM_ENDPOINTS;
+    }
+    if (SNAPSHOT)
+    {
+        printf("Enter retransmission timeout [%.1f]:", P->timeout);
+        scanf("%f", &P->timeout);
+        printf("Enter snapshot file to resume from [- to start at time 0]:");
+        scanf("%255s", S->resumefile);
+        printf("Enter time to save a snapshot at [0.0 for none]:");
+        scanf("%f", &sum);
+        S->snaptime = TICKS(sum);
+        if (S->snaptime > 0)
+        {
+            printf("Enter file to save the snapshot to:");
+            scanf("%255s", S->snapfile);
+        }
+    }
+
+    if (COALESCE)
+    {
+        if (SOCKETS)
+        {
+            printf("COALESCE does not work with SOCKETS\n");
+            exit(1);
+        }
+        printf("Enter time a message may wait for others to share its packet [ > 0.0]:");
+        scanf("%f", &S->flushdelay);
+    }
+    if (FLOW_CONTROL)
+    {
+        printf("Enter receive buffer size in messages [ > 0]:");
+        scanf("%d", &S->rcvbufsize);
+        printf("Enter rate layer 5 takes messages out of it [msgs per time unit]:");
+        scanf("%f", &S->drainrate);
+    }
+    if (METRICS)
+    {
+        if (SOCKETS || PARALLEL)
+        {
+            printf("METRICS does not work with SOCKETS or PARALLEL\n");
+            exit(1);
+        }
+        printf("Enter file to export metrics to [unix:path to serve them on a socket]:");
+        scanf("%255s", S->metricsdest);
+        printf("Enter seconds of real time between exports [ > 0.0]:");
+        scanf("%f", &S->metricsperiod);
+        startmetrics();
+    }
+    if (SAMPLER)
+    {
+        if (SOCKETS || PARALLEL)
+        {
+            printf("SAMPLER does not work with SOCKETS or PARALLEL\n");
+            exit(1);
+        }
+        printf("Enter time between samples [ > 0.0]:");
+        scanf("%f", &S->sampleinterval);
+        S->sampleticks = TICKS(S->sampleinterval);
+        if (S->sampleticks < 1)
+            S->sampleticks = 1;
+        printf("Enter file to write samples to [.csv for CSV, otherwise binary]:");
+        scanf("%255s", S->samplefile);
+        opensamples();
+    }
+    if (STEADY_STATE)
+    {
+        if (SOCKETS || PARALLEL)
+        {
+            printf("STEADY_STATE does not work with SOCKETS or PARALLEL\n");
+            exit(1);
+        }
+        printf("Enter warm-up time [-1 to find it with MSER-5]:");
+        scanf("%f", &S->warmup);
+        printf("Enter observation interval [ > 0.0]:");
+        scanf("%f", &S->obsinterval);
+        S->obsticks = TICKS(S->obsinterval);
+        if (S->obsticks < 1)
+            S->obsticks = 1;
+    }
+    if (DRAIN)
+    {
+        if (SOCKETS || PARALLEL || THREADS || FILE_TRANSFER)
+        {
+            printf("DRAIN does not work with SOCKETS, PARALLEL, THREADS or FILE_TRANSFER\n");
+            exit(1);
+        }
+        printf("Enter longest drain after the last message [0.0 for no limit]:");
+        scanf("%f", &S->draintime);
+    }
+
+    startrun(SEED);
+}
+
+/* reset the emulator for a run seeded with seed, and schedule its first */
+/* message arrival                                                        */
+static void startrun(int seed)
+{
+    struct event *p;
+    int i;
+    float sum, avg;
+    float jimsrand();
+
+    S->runseed = seed;
+    seedrandom(seed); /* init random number generator */
+    sum = 0.0;   /* test random number generator for students */
+    for (i = 0; i < 1000; i++)
+        sum = sum + jimsrand(); /* jimsrand() should be uniform in [0,1] */
+    avg = sum / 1000.0;
+    if (avg < 0.25 || avg > 0.75)
+    {
+        printf("It is likely that random number generation on your machine\n");
+        printf("is different from what this emulator expects.  Please take\n");
+        printf("a look at the routine jimsrand() in the emulator code. Sorry. \n");
+        exit(0);
+    }
+
+    while ((p = nextevent()) != NULL) /* left over from the last run */
+    {
+        if (p->evtype == FROM_LAYER3)
+            free(p->pktptr);
+        free(p);
+    }
+    S->nidtimers = S->nfreeids = 0;
+    S->wheelnow = 0;
+    S->nsim = 0;
+    S->simdone = false;
+    S->latencysum = 0.0;
+    S->nlatency = 0;
+    S->nuntimed = 0;
+    memset(S->latencyhist, 0, sizeof(S->latencyhist));
+    S->latencymax = 0;
+    S->drainstart = -1;
+    S->drained = false;
+    memset(S->lastacked, 0, sizeof(S->lastacked));
+    if (S->obs != NULL)
+        memset(S->obs, 0, S->obssize * sizeof(struct observation));
+    memset(S->vsent, 0, sizeof(S->vsent));
+    memset(S->verify, 0, sizeof(S->verify));
+    memset(S->npending, 0, sizeof(S->npending));
+    memset(S->flushevent, 0, sizeof(S->flushevent));
+    memset(S->rcvfill, 0, sizeof(S->rcvfill));
+    memset(S->rcvdrained, 0, sizeof(S->rcvdrained));
+    S->nrcvoverflow = 0;
+    S->nextsample = S->sampleticks;
+    S->sampledelivered = 0;
+    S->ntolayer3 = 0;
+    S->ninflight = 0;
+    S->nlost = 0;
+    S->ncorrupt = 0;
+    S->nflipped = 0;
+    memset(S->nescaped, 0, sizeof(S->nescaped));
+    S->nqueuedrop = 0;
+    S->nreordered = 0;
+    for (i = 0; i < 2; i++)
+    {
+        S->linkfree[i] = 0;
+        S->queuehead[i] = S->queuelen[i] = 0;
+        S->channel[i].nbad = 0;
+        if (CHANNEL_MODEL == GILBERT_ELLIOTT)
+            enterstate(&S->channel[i], 0);
+        if (CHANNEL_MODEL == BIT_ERRORS)
+            S->channel[i].tobit = geometricskip(S->ber) - 1;
+    }
+    for (i = 0; i < NUM_ENTITIES; i++)
+    {
+        S->lastarrival[i] = 0;
+        S->sendorder[i] = S->ndelivered[i] = 0;
+        S->lastdelivered[i] = -1;
+        S->timerevent[i] = NULL;
+    }
+
+    S->now = 0; /* initialize time to 0.0 */
+    S->tracenext = 0;
+    if (FILE_TRANSFER)
+        startfiles();
+    for (i = 0; i < NUM_ENTITIES; i++)
+    {
+        S->parked[i] = false;
+        S->onuntil[i] = 0;
+    }
+    S->lastdelivery = 0;
+    if (TRAFFIC == UNIFORM || TRAFFIC == TRACE_REPLAY)
+        generate_next_arrival(-1); /* initialize event list */
+    else
+        for (i = 0; i < NUM_ENTITIES; i++)
+            if (i % 2 == A || BIDIRECTIONAL)
+            {
+                if (TRAFFIC == ONOFF)
+                    S->onuntil[i] = TICKS(exponential(S->ontime));
+                generate_next_arrival(i);
+            }
+}
+
+/* hand the next message from layer 5 to entity */
+static void givemessage(int entity)
+{
+    struct msg msg2give;
+    int i, j, n = THREADS ? __atomic_fetch_add(&S->nsim, 1, __ATOMIC_RELAXED) : S->nsim; /* both sides generate */
+
+    if (FILE_TRANSFER)
+        filechunk(entity, msg2give.data);
+    else
+    {
+        /* fill in msg to give with string of same letter */
+        j = n % 26;
+        for (i = 0; i < 20; i++)
+            msg2give.data[i] = 97 + j;
+        if (TIMED)
+            stampmsg(msg2give.data, n);
+        if (VERIFY)
+            tagmsg(entity, msg2give.data);
+    }
+    if (S->TRACE > 2)
+    {
+        printf("          MAINLOOP: data given to student: ");
+        for (i = 0; i < 20; i++)
+            printf("%c", msg2give.data[i]);
+        printf("\n");
+    }
+    if (!THREADS)
+        S->nsim++;
+    if (DRAIN && S->nsim == S->nsimmax)
+        S->drainstart = S->now; /* the drain starts */
+    if (COALESCE)
+        coalesce(entity, msg2give.data);
+    else
+        passmsg(entity, msg2give);
+}
+
+/* hand msg to entity's sender */
+static void passmsg(int entity, struct msg msg)
+{
+    if (entity % 2 == A)
+        A_output(entity / 2, msg);
+    else
+        B_output(entity / 2, msg);
+}
+
+/* true if layer 5 can hand entity another message now */
+static int acceptsmsg(int entity)
+{
+    return COALESCE ? S->npending[entity] < COALESCE_MAX : layer4ready(entity);
+}
+
+/* add a message to the ones entity is gathering, and send them once */
+/* there is no room for more.  A message with no room left is lost.  */
+static void coalesce(int entity, char data[20])
+{
+    struct event *evptr;
+
+    if (S->npending[entity] == COALESCE_MAX)
+    {
+        if (S->TRACE > 0)
+            printf("          COALESCE: no room, dropping msg\n");
+        return;
+    }
+    memcpy(S->pending[entity].data + 1 + S->npending[entity]++ * MSG_SIZE, data, MSG_SIZE);
+    if (S->npending[entity] == COALESCE_MAX)
+        flushmsgs(entity);
+    else if (S->flushevent[entity] == NULL)
+    {
+        evptr = (struct event *)malloc(sizeof(struct event));
+        evptr->evtime = S->now + TICKS(S->flushdelay);
+        evptr->evtype = COALESCE_TIMEOUT;
+        evptr->eventity = entity;
+        insertevent(evptr);
+        S->flushevent[entity] = evptr;
+    }
+}
+
+/* send the messages entity has gathered as one, unless its sender */
+/* would refuse them: then they wait for it to take them           */
+static void flushmsgs(int entity)
+{
+    int n = S->npending[entity];
+
+    if (S->flushevent[entity] != NULL)
+    {
+        removeevent(S->flushevent[entity]);
+        free(S->flushevent[entity]);
+        S->flushevent[entity] = NULL;
+    }
+    if (n == 0 || !layer4ready(entity))
+        return;
+    S->pending[entity].data[0] = '0' + n;
+    memset(S->pending[entity].data + 1 + n * MSG_SIZE, 0, (COALESCE_MAX - n) * MSG_SIZE);
+    S->npending[entity] = 0;
+    passmsg(entity, S->pending[entity]);
+}
+
+/* take out of AorB's receive buffer what layer 5 has consumed since */
+/* it last looked */
+static void drainbuffer(int AorB)
+{
+    S->rcvfill[AorB] -= S->drainrate * UNITS(S->now - S->rcvdrained[AorB]);
+    if (S->rcvfill[AorB] < 0.0)
+        S->rcvfill[AorB] = 0.0;
+    S->rcvdrained[AorB] = S->now;
+}
+
+/* messages the receive buffer at AorB has room for now */
+static int layer5room(int AorB)
+{
+    drainbuffer(AorB);
+    return S->rcvbufsize - (int)ceil(S->rcvfill[AorB]);
+}
+
+/* what coalescing did to the cost of a message */
+static void printcoalescestats(void)
+{
+    long delivered = 0;
+    int i;
+
+    for (i = 0; i < NUM_ENTITIES; i++)
+        delivered += S->ndelivered[i];
+    printf(" up to %d msgs a packet: %ld msgs delivered, %ld packets into layer3, %ld events;\n",
+           COALESCE_MAX, delivered, S->ntolayer3, S->nprocessed);
+    printf("   %.3f packets and %.3f events per msg delivered\n", delivered ? (double)S->ntolayer3 / delivered : 0.0,
+           delivered ? (double)S->nprocessed / delivered : 0.0);
+}
+
+/* write the low 4n bits of v at s as n hex digits, without a '\0' */
+static void puthex(char *s, unsigned long v, int n)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    while (n-- > 0)
+    {
+        s[n] = digits[v & 15];
+        v >>= 4;
+    }
+}
+
+/* write message number n into the last 8 bytes of a message */
+static void stampmsg(char data[20], int n)
+{
+    S->gentime[n % GENRING] = NOW;
+    puthex(data + 12, (unsigned)n, 8);
+}
+
+/* hash of a message as sent by entity, over all but its hash field */
+static unsigned msghash(int entity, char data[20])
+{
+    uint32_t h = 2166136261u ^ entity;
+    int i;
+
+    for (i = 0; i < 20; i++)
+        if (i < 8 || i >= 12)
+            h = (h ^ (unsigned char)data[i]) * 16777619u;
+    return (h ^ h >> 16) & 0xffff;
+}
+
+/* number a message in entity's stream and seal it with its hash.  A */
+/* message the sender is going to refuse does not use up a number.   */
+static void tagmsg(int entity, char data[20])
+{
+    puthex(data, S->vsent[entity], 8);
+    if (acceptsmsg(entity))
+        S->vsent[entity]++;
+    puthex(data + 8, msghash(entity, data), 4);
+}
+
+/* the n hex digits at s, or -1 if they are not all hex digits */
+static long hexfield(char *s, int n)
+{
+    long v = 0;
+    int i, d;
+
+    for (i = 0; i < n; i++)
+    {
+        if (s[i] >= '0' && s[i] <= '9')
+            d = s[i] - '0';
+        else if (s[i] >= 'a' && s[i] <= 'f')
+            d = s[i] - 'a' + 10;
+        else
+            return -1;
+        v = v << 4 | d;
+    }
+    return v;
+}
+
+/* check a message delivered to AorB against the stream its peer sent */
+static void verifymsg(int AorB, char data[20])
+{
+    struct verifier *v = &S->verify[AorB];
+    long seq = hexfield(data, 8);
+    int32_t ahead;
+    int behind;
+
+    if (seq < 0 || hexfield(data + 8, 4) != msghash(AorB ^ 1, data))
+    {
+        v->corrupt++;
+        return;
+    }
+    ahead = (int32_t)((uint32_t)seq - v->next);
+    if (ahead >= 0)
+    {
+        v->inorder++;
+        v->missing += ahead;
+        v->window = ahead < 63 ? v->window << (ahead + 1) | 1 : 1;
+        v->next = (uint32_t)seq + 1;
+        return;
+    }
+    behind = -(ahead + 1); /* bit of the window seq is on */
+    if (behind >= 64)
+        v->stale++;
+    else if (v->window >> behind & 1)
+        v->duplicate++;
+    else
+    {
+        v->window |= 1ull << behind;
+        v->late++;
+        v->missing--;
+    }
+}
+
+/* what the delivery check found over all the streams */
+static void printverify(void)
+{
+    struct verifier t;
+    long unsent = 0;
+    int e;
+
+    memset(&t, 0, sizeof(t));
+    for (e = 0; e < NUM_ENTITIES; e++)
+    {
+        t.inorder += S->verify[e].inorder;
+        t.late += S->verify[e].late;
+        t.duplicate += S->verify[e].duplicate;
+        t.stale += S->verify[e].stale;
+        t.corrupt += S->verify[e].corrupt;
+        t.missing += S->verify[e].missing;
+        unsent += (uint32_t)(S->vsent[e ^ 1] - S->verify[e].next);
+    }
+    printf(" delivery check %s: %ld in order, %ld late, %ld duplicated, %ld too late to tell, %ld corrupted,\n",
+           t.late || t.duplicate || t.stale || t.corrupt || t.missing ? "FAILED" : "passed",
+           t.inorder, t.late, t.duplicate, t.stale, t.corrupt);
+    printf("   %ld missing, %ld after the last one delivered\n", t.missing, unsent);
+}
+
+/* bucket of the latency histogram a delay of t ticks goes in: t itself */
+/* below 8, then the position of its top bit and the 3 bits after it    */
+static int latencybucket(simtime t)
+{
+    int top;
+
+    if (t < 8)
+        return t < 0 ? 0 : (int)t;
+    top = 63 - __builtin_clzll(t);
+    return 8 * top + (int)((t >> (top - 3)) & 7) - 16;
+}
+
+/* the smallest delay that goes in bucket b */
+static simtime bucketstart(int b)
+{
+    if (b < 8)
+        return b;
+    return (simtime)(8 + (b + 16) % 8) << ((b + 16) / 8 - 3);
+}
+
+/* the q quantile of the delays measured so far, from the middle of the */
+/* bucket it falls in */
+static double latencyquantile(double q)
+{
+    long total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++)
+        total += S->latencyhist[b];
+    for (b = 0; b < LATENCY_BUCKETS && total > 0; b++)
+    {
+        seen += S->latencyhist[b];
+        if (seen >= q * total)
+            return UNITS(bucketstart(b) + bucketstart(b + 1)) / 2;
+    }
+    return 0.0;
+}
+
+/* true once a delivery has been timed; with PARALLEL none are, as a */
+/* message's generation time stays in its sender's partition         */
+static int latencymeasured(void)
+{
+    return S->nlatency > 0;
+}
+
+/* messages delivered to layer 5 per time unit so far */
+static double goodput(void)
+{
+    double delivered = 0.0;
+    int i;
+
+    for (i = 0; i < NUM_ENTITIES; i++)
+        delivered += S->ndelivered[i];
+    return S->now > 0 ? delivered / UNITS(S->now) : 0.0;
+}
+
+/* add one replication's result to a running mean and variance */
+static void addsample(struct runstat *st, double x)
+{
+    double delta = x - st->mean;
+
+    st->n++;
+    st->mean += delta / st->n;
+    st->m2 += delta * (x - st->mean);
+}
+
+/* half width of the 95% confidence interval of the mean, using Student's t */
+static double halfwidth(struct runstat *st)
+{
+    static const double t95[30] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                   2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    int df = st->n - 1;
+
+    if (df < 1)
+        return HUGE_VAL;
+    return (df <= 30 ? t95[df - 1] : 1.960) * sqrt(st->m2 / df / st->n);
+}
+
+/* observation interval k, made room for */
+static struct observation *interval(long k)
+{
+    long size = S->obssize;
+
+    if (k >= S->obssize)
+    {
+        while (size <= k)
+            size = size ? 2 * size : 1024;
+        S->obs = (struct observation *)realloc(S->obs, size * sizeof(struct observation));
+        memset(S->obs + S->obssize, 0, (size - S->obssize) * sizeof(struct observation));
+        S->obssize = size;
+    }
+    return &S->obs[k];
+}
+
+/* intervals in the warm-up of the first n, according to MSER-5: of the */
+/* truncations in whole batches of 5 over the first half of the run, the */
+/* one leaving the smallest MSER statistic, the variance of the batch    */
+/* means left over the square of how many there are                      */
+static long mser5(long n)
+{
+    long m = n / 5, d, j, best = 0;
+    double *z, sum = 0.0, sumsq = 0.0, stat, beststat = HUGE_VAL;
+
+    if (m < 2)
+        return 0;
+    z = (double *)malloc(m * sizeof(double));
+    for (j = 0; j < m; j++)
+        z[j] = (S->obs[5 * j].delivered + S->obs[5 * j + 1].delivered + S->obs[5 * j + 2].delivered +
+                S->obs[5 * j + 3].delivered + S->obs[5 * j + 4].delivered) / 5.0;
+    for (d = m - 1; d >= 0; d--) /* backwards, adding one batch mean at a time */
+    {
+        sum += z[d];
+        sumsq += z[d] * z[d];
+        if (d <= m / 2)
+        {
+            stat = (sumsq - sum * sum / (m - d)) / ((double)(m - d) * (m - d));
+            if (stat <= beststat)
+            {
+                beststat = stat;
+                best = d;
+            }
+        }
+    }
+    free(z);
+    return 5 * best;
+}
+
+/* cut the warm-up off this run and estimate steady-state goodput and */
+/* latency from batch means over the rest                             */
+static void printsteadystate(void)
+{
+    struct runstat goodput, latency;
+    long n = S->now / S->obsticks, cut, per, b, k, delivered, nlat;
+    double latsum;
+
+    memset(&goodput, 0, sizeof(goodput));
+    memset(&latency, 0, sizeof(latency));
+    if (n > 0)
+        interval(n - 1);
+    if (S->warmup >= 0)
+        cut = (TICKS(S->warmup) + S->obsticks - 1) / S->obsticks;
+    else
+        cut = mser5(n);
+    if (cut > n)
+        cut = n;
+    per = (n - cut) / NUM_BATCHES;
+    S->steadygoodput = S->steadylatency = 0.0;
+    if (per < 1)
+    {
+        printf(" %ld intervals left after a warm-up of %f, too few for %d batches\n",
+               n - cut, cut * UNITS(S->obsticks), NUM_BATCHES);
+        return;
+    }
+    for (b = 0; b < NUM_BATCHES; b++)
+    {
+        delivered = nlat = 0;
+        latsum = 0.0;
+        for (k = cut + b * per; k < cut + (b + 1) * per; k++)
+        {
+            delivered += S->obs[k].delivered;
+            nlat += S->obs[k].nlatency;
+            latsum += S->obs[k].latencysum;
+        }
+        addsample(&goodput, delivered / (per * UNITS(S->obsticks)));
+        if (nlat > 0)
+            addsample(&latency, latsum / nlat);
+    }
+    S->steadygoodput = goodput.mean;
+    S->steadylatency = latency.mean;
+    printf(" warm-up of %f time units cut off (%s); %d batches of %f after it:\n",
+           cut * UNITS(S->obsticks), S->warmup >= 0 ? "as set" : "MSER-5", NUM_BATCHES, per * UNITS(S->obsticks));
+    printf("   steady-state goodput %f +- %f msgs per time unit, latency %f +- %f (95%% CI)\n",
+           goodput.mean, halfwidth(&goodput), latency.mean, halfwidth(&latency));
+}
+
+/* record the results of replication n; true once no more are needed */
+static int replicationdone(int n)
+{
+    double delivered = 0.0, goodput, latency;
+    int i, done;
+
+    for (i = 0; i < NUM_ENTITIES; i++)
+        delivered += S->ndelivered[i];
+    goodput = S->now > 0 ? delivered / UNITS(S->now) : 0.0;
+    latency = S->nlatency > 0 ? S->latencysum / S->nlatency : 0.0;
+    if (STEADY_STATE)
+    {
+        goodput = S->steadygoodput;
+        latency = S->steadylatency;
+    }
+    addsample(&S->goodputstat, goodput);
+    addsample(&S->latencystat, latency);
+    printf(" replication %d (seed %d): goodput %f msgs per time unit, mean latency %f\n",
+           n, SEED + n - 1, goodput, latency);
+
+    done = n >= REPLICATIONS ||
+           (n >= MIN_REPLICATIONS &&
+            halfwidth(&S->goodputstat) <= CI_TARGET * fabs(S->goodputstat.mean) &&
+            halfwidth(&S->latencystat) <= CI_TARGET * fabs(S->latencystat.mean));
+    if (done)
+    {
+        printf(" after %d replications:\n", n);
+        printf("   goodput %f +- %f msgs per time unit (95%% CI)\n", S->goodputstat.mean, halfwidth(&S->goodputstat));
+        printf("   latency %f +- %f time units (95%% CI)\n", S->latencystat.mean, halfwidth(&S->latencystat));
+    }
+    return done;
+}
+
+/* true, and drained set, once no sender has anything waiting */
+static int draindone(void)
+{
+    int e;
+
+    for (e = 0; e < NUM_ENTITIES; e++)
+        if (layer4window(e) > 0 || (COALESCE && S->npending[e] > 0))
+            return false;
+    return S->drained = true;
+}
+
+/* how the drain went, each flow's completion time, and the latency tail */
+static void printdrainstats(void)
+{
+    simtime fct, fctmax = 0;
+    double fctsum = 0.0;
+    long delivered = 0;
+    int f, e, ndone = 0;
+
+    for (e = 0; e < NUM_ENTITIES; e++)
+        delivered += S->ndelivered[e];
+    printf(" drained for %f time units after the last message (%s); %ld msgs never delivered\n",
+           S->drainstart >= 0 ? UNITS(S->now - S->drainstart) : 0.0, S->drained ? "nothing left waiting" : "gave up",
+           S->nsim - delivered);
+    for (f = 0; f < NUM_FLOWS; f++)
+    {
+        if (layer4window(ENTITY(f, A)) > 0 || (BIDIRECTIONAL && layer4window(ENTITY(f, B)) > 0))
+        {
+            if (NUM_FLOWS > 1)
+                printf("   flow %d not completed\n", f);
+            continue;
+        }
+        ndone++;
+        fct = S->lastacked[ENTITY(f, A)];
+        if (BIDIRECTIONAL && S->lastacked[ENTITY(f, B)] > fct)
+            fct = S->lastacked[ENTITY(f, B)];
+        if (NUM_FLOWS > 1)
+            printf("   flow %d completed at %f\n", f, UNITS(fct));
+        fctsum += UNITS(fct);
+        if (fct > fctmax)
+            fctmax = fct;
+    }
+    printf("   %d of %d flows completed; completion time mean %f, max %f\n", ndone, NUM_FLOWS,
+           ndone > 0 ? fctsum / ndone : 0.0, UNITS(fctmax));
+    printf("   latency median %f, 90th %f, 99th %f, 99.9th percentile %f, max %f\n", latencyquantile(0.5),
+           latencyquantile(0.9), latencyquantile(0.99), latencyquantile(0.999), UNITS(S->latencymax));
+}
+
+/* aggregate and per-flow delivery, for runs with more than one flow.    */
+/* Fairness is Jain's index over the messages each flow delivered.       */
+static void printflowstats(void)
+{
+    double total = 0.0, sumsq = 0.0, flowtotal;
+    int endpoint[NUM_ENDPOINTS];
+    int f, i;
+
+    for (i = 0; i < NUM_ENDPOINTS; i++)
+        endpoint[i] = 0;
+    for (f = 0; f < NUM_FLOWS; f++)
+    {
+        flowtotal = S->ndelivered[ENTITY(f, A)] + S->ndelivered[ENTITY(f, B)];
+        total += flowtotal;
+        sumsq += flowtotal * flowtotal;
+        endpoint[flowendpoint(ENTITY(f, A))] += S->ndelivered[ENTITY(f, A)];
+        endpoint[flowendpoint(ENTITY(f, B))] += S->ndelivered[ENTITY(f, B)];
+    }
+    printf(" %d flows delivered %.0f msgs, %f msgs per time unit, fairness %f\n",
+           NUM_FLOWS, total, S->now > 0 ? total / UNITS(S->now) : 0.0,
+           sumsq > 0 ? total * total / (NUM_FLOWS * sumsq) : 1.0);
+    for (i = 0; i < NUM_ENDPOINTS; i++)
+        printf("   endpoint %d received %d msgs\n", i, endpoint[i]);
+}
+
+/* host an entity runs on: A sides round-robin over the first half of */
+/* the endpoints, B sides over the second half                         */
+static int flowendpoint(int entity)
+{
+    int left = NUM_ENDPOINTS / 2;
+
+    if (entity % 2 == A)
+        return (entity / 2) % left;
+    return left + (entity / 2) % (NUM_ENDPOINTS - left);
+}
+
+/* number of packets up to and including the next one hit by an event of */
+/* probability p, i.e. a geometric variate drawn with a single random     */
+/* number instead of one per packet                                       */
+static int64_t geometricskip(double p)
+{
+    double u, n;
+    float jimsrand();
+
+    if (p <= 0.0)
+        return SKIP_NEVER;
+    if (p >= 1.0)
+        return 1;
+    do
+        u = jimsrand();
+    while (u <= 0.0);
+    n = 1 + floor(log(u) / log1p(-p)); /* log1p keeps tiny bit error rates exact */
+    return n < (double)SKIP_NEVER ? (int64_t)n : SKIP_NEVER;
+}
+
+/* put a Gilbert-Elliott channel in state bad and draw its countdowns */
+static void enterstate(struct gechannel *ch, int bad)
+{
+    ch->bad = bad;
+    ch->tostate = geometricskip(ch->leave[bad]);
+    ch->toloss = geometricskip(ch->loss[bad]);
+    ch->tocorrupt = geometricskip(ch->corrupt[bad]);
+}
+
+/* decide whether the packet entity AorB is sending now is lost.  For the */
+/* Gilbert-Elliott model this also advances the chain by one packet and   */
+/* decides corruption, which channelcorrupts() then reports.              */
+static int channelloses(int AorB)
+{
+    struct gechannel *ch = &S->channel[AorB % 2];
+    int lost;
+    float jimsrand();
+
+    if (CHANNEL_MODEL != GILBERT_ELLIOTT)
+        return jimsrand() < S->lossprob;
+
+    if (ch->bad)
+        ch->nbad++;
+    lost = --ch->toloss == 0;
+    if (lost)
+        ch->toloss = geometricskip(ch->loss[ch->bad]);
+    ch->corruptnow = --ch->tocorrupt == 0;
+    if (ch->corruptnow)
+        ch->tocorrupt = geometricskip(ch->corrupt[ch->bad]);
+    if (--ch->tostate == 0)
+        enterstate(ch, !ch->bad);
+    return lost;
+}
+
+static int channelcorrupts(int AorB)
+{
+    float jimsrand();
+
+    if (CHANNEL_MODEL == BERNOULLI)
+        return jimsrand() < S->corruptprob;
+    return S->channel[AorB % 2].corruptnow;
+}
+
+/****************************************************************************/
+/* jimsrand(): return a float in range [0,1].  The routine below is used to */
+/* isolate all random number generation in one location.  The numbers come */
+/* from nextrandom(), the same additive feedback generator as the C       */
+/* library's rand() (so the default seed gives the familiar runs), but     */
+/* with its state in rngstate where a snapshot can save it.                */
+/****************************************************************************/
+static void seedrandom(unsigned seed)
+{
+    int32_t *r = (int32_t *)S->rngstate.r;
+    int i;
+
+    r[0] = seed ? seed : 1;
+    for (i = 1; i < 31; i++)
+    {
+        r[i] = (16807LL * r[i - 1]) % 2147483647;
+        if (r[i] < 0)
+            r[i] += 2147483647;
+    }
+    for (i = 31; i < 34; i++)
+        r[i] = r[i - 31];
+    S->rngstate.i = 0;
+    for (i = 0; i < 310; i++) /* discard the first, poorly mixed values */
+        nextrandom();
+}
+
+static int nextrandom(void)
+{
+    int i = S->rngstate.i;
+
+    S->rngstate.r[i] = S->rngstate.r[(i + 3) % 34] + S->rngstate.r[(i + 31) % 34];
+    S->rngstate.i = (i + 1) % 34;
+    return S->rngstate.r[i] >> 1;
+}
+
+static float jimsrand(void)
+{
+    double mmm = 2147483647.0; /* largest int nextrandom() returns */
+    float x;
+    x = nextrandom() / mmm; /* x should be uniform in [0,1] */
     return (x);
 }
 
-/********************* EVENT HANDLINE ROUTINES *******/
-/*  The next set of routines handle the event list   */
-/*****************************************************/
-
-generate_next_arrival(void)
+/* print and clear the PROFILE counts */
+static void printprofile(void)
+{
+    static char *name[PROF_SITES] = {"insertevent", "stoptimer", "starttimer", "tolayer3",
+                                     "calculateChecksum", "A_output", "A_input", "A_timerinterrupt",
+                                     "B_output", "B_input", "B_timerinterrupt"};
+    int i;
+
+    printf(" %-20s %12s %16s %12s\n", "site", "calls", "cycles", "per call");
+    for (i = 0; i < PROF_SITES; i++)
+    {
+        if (profcalls[i] > 0)
+            printf(" %-20s %12llu %16llu %12.1f\n", name[i], (unsigned long long)profcalls[i],
+                   (unsigned long long)profcycles[i], (double)profcycles[i] / profcalls[i]);
+        profcalls[i] = profcycles[i] = 0;
+    }
+}
+
+/************************ SNAPSHOTS *****************/
+
+/* emulator state saved with a snapshot, besides the event list and channels */
+static struct statevar emulatorState[] = {
+    STATEVAR(struct simstate, now),
+    STATEVAR(struct simstate, nsim),
+    STATEVAR(struct simstate, nextevseq),
+    STATEVAR(struct simstate, ntolayer3),
+    STATEVAR(struct simstate, ninflight),
+    STATEVAR(struct simstate, nextsample),
+    STATEVAR(struct simstate, sampledelivered),
+    STATEVAR(struct simstate, nlost),
+    STATEVAR(struct simstate, ncorrupt),
+    STATEVAR(struct simstate, nflipped),
+    STATEVAR(struct simstate, nescaped),
+    STATEVAR(struct simstate, nqueuedrop),
+    STATEVAR(struct simstate, nreordered),
+    STATEVAR(struct simstate, latencysum),
+    STATEVAR(struct simstate, nlatency),
+    STATEVAR(struct simstate, nuntimed),
+    STATEVAR(struct simstate, latencyhist),
+    STATEVAR(struct simstate, latencymax),
+    STATEVAR(struct simstate, drainstart),
+    STATEVAR(struct simstate, lastacked),
+    STATEVAR(struct simstate, linkfree),
+    STATEVAR(struct simstate, queuedepart),
+    STATEVAR(struct simstate, queuehead),
+    STATEVAR(struct simstate, queuelen),
+    STATEVAR(struct simstate, lastarrival),
+    STATEVAR(struct simstate, sendorder),
+    STATEVAR(struct simstate, lastdelivered),
+    STATEVAR(struct simstate, ndelivered),
+    STATEVAR(struct simstate, vsent),
+    STATEVAR(struct simstate, verify),
+    STATEVAR(struct simstate, pending),
+    STATEVAR(struct simstate, npending),
+    STATEVAR(struct simstate, rcvfill),
+    STATEVAR(struct simstate, rcvdrained),
+    STATEVAR(struct simstate, nrcvoverflow),
+    STATEVAR(struct simstate, gentime),
+    STATEVAR(struct simstate, rngstate),
+    STATEVAR(struct simstate, onuntil),
+    STATEVAR(struct simstate, parked),
+    STATEVAR(struct simstate, lastdelivery),
+    STATEVAR(struct simstate, tracenext),
+    STATEVAR(struct simstate, filesent),
+    STATEVAR(struct simstate, filercvd),
+    STATEVAR(struct simstate, rcvdhash),
+    STATEVAR(struct simstate, nstreams),
+};
+
+/* the parts of a snapshot file, in the order they are written */
+struct snapheader
+{
+    char magic[8];
+    int entities;   /* NUM_ENTITIES of the writer */
+    int statesize;  /* total size of emulator and protocol state */
+    int nevents;
+};
+
+/* the part of an event that goes into a snapshot */
+struct snapevent
+{
+    simtime evtime;
+    long evseq;
+    long order;
+    int evtype;
+    int eventity;
+    int timerid;
+    struct pkt pkt;
+};
+
+static int statesize(void)
+{
+    size_t v;
+    int size = 0;
+
+    for (v = 0; v < sizeof(emulatorState) / sizeof(emulatorState[0]); v++)
+        size += emulatorState[v].size;
+    for (v = 0; v < sizeof(protocolState) / sizeof(protocolState[0]); v++)
+        size += protocolState[v].size;
+    return size + sizeof(S->channel);
+}
+
+/* write event p to a snapshot */
+static void snapevent(FILE *f, struct event *p)
+{
+    struct snapevent se;
+
+    memset(&se, 0, sizeof(se));
+    se.evtime = p->evtime;
+    se.evseq = p->evseq;
+    se.order = p->order;
+    se.evtype = p->evtype;
+    se.eventity = p->eventity;
+    se.timerid = se.evtype == TIMER_INTERRUPT ? p->timerid : -1;
+    if (se.evtype == FROM_LAYER3)
+        se.pkt = *p->pktptr;
+    fwrite(&se, sizeof(se), 1, f);
+}
+
+/* write the whole state of the simulation to file name */
+static void snapshot(char *name)
+{
+    struct snapheader h;
+    struct event *p;
+    FILE *f;
+    size_t v;
+    int i;
+
+    if ((f = fopen(name, "wb")) == NULL)
+    {
+        printf("Unable to write snapshot %s\n", name);
+        exit(1);
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.entities = NUM_ENTITIES;
+    h.statesize = statesize();
+    h.nevents = S->nevents + S->nwheel;
+    fwrite(&h, sizeof(h), 1, f);
+    for (v = 0; v < sizeof(emulatorState) / sizeof(emulatorState[0]); v++)
+        fwrite((char *)S + emulatorState[v].offset, emulatorState[v].size, 1, f);
+    for (v = 0; v < sizeof(protocolState) / sizeof(protocolState[0]); v++)
+        fwrite((char *)P + protocolState[v].offset, protocolState[v].size, 1, f);
+    fwrite(S->channel, sizeof(S->channel), 1, f);
+    for (i = 0; i < S->nevents; i++)
+        snapevent(f, S->evlist[i]);
+    for (i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++)
+        for (p = S->wheel[i / WHEEL_SLOTS][i % WHEEL_SLOTS]; p != NULL; p = p->wnext)
+            snapevent(f, p);
+    if (fclose(f) != 0)
+    {
+        printf("Unable to write snapshot %s\n", name);
+        exit(1);
+    }
+    printf(" Snapshot of %d events saved to %s at time %f\n", h.nevents, name, UNITS(S->now));
+}
+
+/* replace the state of the simulation with the snapshot in file name */
+static void restore(char *name)
+{
+    struct gechannel saved[2];
+    struct snapheader h;
+    struct snapevent se;
+    struct event *p;
+    FILE *f;
+    size_t v;
+    int i, ok;
+
+    if ((f = fopen(name, "rb")) == NULL)
+    {
+        printf("Unable to read snapshot %s\n", name);
+        exit(1);
+    }
+    ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) == 0 &&
+         h.entities == NUM_ENTITIES && h.statesize == statesize();
+    for (v = 0; ok && v < sizeof(emulatorState) / sizeof(emulatorState[0]); v++)
+        ok = fread((char *)S + emulatorState[v].offset, emulatorState[v].size, 1, f) == 1;
+    for (v = 0; ok && v < sizeof(protocolState) / sizeof(protocolState[0]); v++)
+        ok = fread((char *)P + protocolState[v].offset, protocolState[v].size, 1, f) == 1;
+    ok = ok && fread(saved, sizeof(saved), 1, f) == 1;
+    if (!ok)
+    {
+        printf("%s is not a snapshot of this simulator\n", name);
+        exit(1);
+    }
+
+    while ((p = nextevent()) != NULL) /* the fresh run's first arrival */
+        free(p);
+    for (i = 0; i < NUM_ENTITIES; i++)
+        S->timerevent[i] = S->flushevent[i] = NULL;
+    S->wheelnow = 0;
+    for (i = 0; i < h.nevents; i++)
+    {
+        if (fread(&se, sizeof(se), 1, f) != 1)
+        {
+            printf("Snapshot %s is truncated\n", name);
+            exit(1);
+        }
+        p = (struct event *)malloc(sizeof(struct event));
+        p->evtime = se.evtime;
+        p->evseq = se.evseq;
+        p->order = se.order;
+        p->evtype = se.evtype;
+        p->eventity = se.eventity;
+        p->timerid = se.timerid;
+        if (se.evtype == FROM_LAYER3)
+        {
+            p->pktptr = (struct pkt *)malloc(sizeof(struct pkt));
+            *p->pktptr = se.pkt;
+        }
+        else if (se.evtype == TIMER_INTERRUPT && se.timerid >= 0)
+        {
+            while (se.timerid >= S->idtimersize)
+                growtimers();
+            while (S->nidtimers <= se.timerid)
+                S->idtimers[S->nidtimers++] = NULL;
+            S->idtimers[se.timerid] = p;
+        }
+        else if (se.evtype == TIMER_INTERRUPT)
+            S->timerevent[se.eventity] = p;
+        else if (se.evtype == COALESCE_TIMEOUT)
+            S->flushevent[se.eventity] = p;
+        addevent(p);
+    }
+    for (i = 0; i < S->nidtimers; i++) /* the ids of timers not running */
+        if (S->idtimers[i] == NULL)
+            S->freeids[S->nfreeids++] = i;
+    fclose(f);
+
+    /* keep the channel state but use this run's error probabilities */
+    for (i = 0; i < 2; i++)
+    {
+        S->channel[i].nbad = saved[i].nbad;
+        if (CHANNEL_MODEL == GILBERT_ELLIOTT)
+            enterstate(&S->channel[i], saved[i].bad);
+    }
+    printf(" Resumed from snapshot %s at time %f\n", name, UNITS(S->now));
+}
+
+/************************ FILE TRANSFER *****************/
+
+/* add n bytes to an Adler-32 checksum */
+static uint32_t adler32(uint32_t hash, unsigned char *data, long n)
+{
+    uint32_t a = hash & 0xffff, b = hash >> 16;
+    long i;
+
+    for (i = 0; i < n; i++)
+    {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+/* map the file to send and open the one to write */
+static void openfiles(void)
+{
+    struct stat st;
+    int fd, senders;
+
+    if ((fd = open(S->sendfile, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        printf("Unable to open %s\n", S->sendfile);
+        exit(1);
+    }
+    S->filesize = st.st_size;
+    S->filedata = NULL;
+    if (S->filesize > 0)
+    {
+        S->filedata = (unsigned char *)mmap(NULL, S->filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (S->filedata == MAP_FAILED)
+        {
+            printf("Unable to map %s\n", S->sendfile);
+            exit(1);
+        }
+        madvise(S->filedata, S->filesize, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    S->filehash = adler32(1, S->filedata, S->filesize);
+
+    /* every sender sends every 20 byte piece once */
+    senders = BIDIRECTIONAL ? NUM_ENTITIES : NUM_FLOWS;
+    S->nsimmax = (int)((S->filesize + 19) / 20) * senders;
+    printf("Sending %s, %ld bytes, to %d receivers in %d messages\n", S->sendfile, S->filesize, senders, S->nsimmax);
+}
+
+/* rewind every stream for a new run */
+static void startfiles(void)
+{
+    int i;
+
+    S->nstreams = 0;
+    for (i = 0; i < NUM_ENTITIES; i++)
+    {
+        S->filesent[i] = S->filercvd[i] = 0;
+        S->rcvdhash[i] = 1;
+        if (S->filesize > 0 && (i % 2 == A || BIDIRECTIONAL))
+            S->nstreams++;
+    }
+    if (S->outfile != NULL)
+        fclose(S->outfile);
+    if ((S->outfile = fopen(S->recvfile, "w")) == NULL)
+    {
+        printf("Unable to create %s\n", S->recvfile);
+        exit(1);
+    }
+    setvbuf(S->outfile, NULL, _IOFBF, FILE_BUFFER);
+    clock_gettime(CLOCK_MONOTONIC, &S->filestart);
+}
+
+/* fill a message with the next piece of entity's copy of the file */
+static void filechunk(int entity, char data[20])
+{
+    long n = S->filesize - S->filesent[entity];
+
+    if (n > 20)
+        n = 20;
+    memset(data, 0, 20);
+    memcpy(data, S->filedata + S->filesent[entity], n);
+    S->filesent[entity] += n;
+}
+
+/* take the next piece of the file delivered to AorB */
+static void filereceive(int AorB, char data[20])
+{
+    long n = S->filesize - S->filercvd[AorB];
+
+    if (n > 20)
+        n = 20;
+    if (n <= 0)
+        return; /* more than was sent: the checksum will not match */
+    S->rcvdhash[AorB] = adler32(S->rcvdhash[AorB], (unsigned char *)data, n);
+    if (AorB == ENTITY(0, B))
+        fwrite(data, 1, n, S->outfile);
+    S->filercvd[AorB] += n;
+    if (S->filercvd[AorB] == S->filesize)
+        S->nstreams--;
+}
+
+/* how the transfer went */
+static void printfilestats(void)
+{
+    struct timespec end;
+    double seconds;
+    long total = 0;
+    int i, good = 0, streams = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - S->filestart.tv_sec) + (end.tv_nsec - S->filestart.tv_nsec) / 1e9;
+    fflush(S->outfile);
+    for (i = 0; i < NUM_ENTITIES; i++)
+        if (i % 2 == B || BIDIRECTIONAL)
+        {
+            streams++;
+            total += S->filercvd[i];
+            if (S->filercvd[i] == S->filesize && S->rcvdhash[i] == S->filehash)
+                good++;
+        }
+    printf(" %d of %d copies of %s arrived intact (adler32 %08x); %ld bytes written to %s\n", good, streams,
+           S->sendfile, (unsigned)S->filehash, S->filercvd[ENTITY(0, B)], S->recvfile);
+    printf(" %ld bytes delivered: %.3f bytes per time unit, %.3f MB/s of wall clock\n", total,
+           S->now > 0 ? total / UNITS(S->now) : 0.0, seconds > 0 ? total / seconds / 1e6 : 0.0);
+}
+
+/************************ WORKER PROCESSES *****************/
+
+/* map the statistics the workers report back through */
+static void mapstats(void)
+{
+    S->workerstats = (struct workerstats *)mmap(NULL, MAX_WORKERS * sizeof(struct workerstats),
+                                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    S->entitystats = (struct entitystats *)mmap(NULL, NUM_ENTITIES * sizeof(struct entitystats),
+                                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    S->workerprotocol = (struct protocolstate *)mmap(NULL, sizeof(struct protocolstate), PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (S->workerstats == MAP_FAILED || S->entitystats == MAP_FAILED || S->workerprotocol == MAP_FAILED)
+    {
+        printf("Unable to map the worker statistics\n");
+        exit(1);
+    }
+    memset(S->workerstats, 0, MAX_WORKERS * sizeof(struct workerstats));
+}
+
+/* run body in nworkers processes, each pinned to a core, and wait for */
+/* them; a single worker runs in this process                          */
+static void runworkers(void (*body)(void))
+{
+    cpu_set_t cpus;
+    pid_t pid[MAX_WORKERS];
+    int w;
+
+    if (S->nworkers == 1)
+    {
+        S->worker = 0;
+        body();
+        return;
+    }
+    for (w = 0; w < S->nworkers; w++)
+        if ((pid[w] = fork()) == 0)
+        {
+            S->worker = w;
+            setvbuf(stdout, NULL, _IOLBF, 0); /* whole lines between workers */
+            CPU_ZERO(&cpus);
+            CPU_SET(w % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+            sched_setaffinity(0, sizeof(cpus), &cpus);
+            seedrandom(nextrandom() + w); /* workers must not lose the same packets */
+            body();
+            fflush(NULL); /* stdout, and the received file */
+            _exit(0);
+        }
+        else if (pid[w] < 0)
+        {
+            printf("Unable to start worker %d\n", w);
+            exit(1);
+        }
+    for (w = 0; w < S->nworkers; w++)
+        waitpid(pid[w], NULL, 0);
+}
+
+/* report this worker's counters; it delivered delivered messages and */
+/* started at start                                                    */
+static void reportworker(long delivered, struct timespec *start)
+{
+    struct workerstats *ws = &S->workerstats[S->worker];
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ws->nsim = S->nsim;
+    ws->ndelivered = delivered;
+    ws->ntolayer3 = S->ntolayer3;
+    ws->nlost = S->nlost;
+    ws->ncorrupt = S->ncorrupt;
+    ws->nsyscalls = S->nsyscalls;
+    ws->nsenddrop = S->nsenddrop;
+    ws->nlatency = S->nlatency;
+    ws->nuntimed = S->nuntimed;
+    ws->nqueuedrop = S->nqueuedrop;
+    ws->nreordered = S->nreordered;
+    ws->nprocessed = S->nprocessed;
+    ws->nwindows = S->nwindows;
+    ws->latencysum = S->latencysum;
+    memcpy(ws->latencyhist, S->latencyhist, sizeof(S->latencyhist));
+    ws->seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    ws->time = S->now;
+}
+
+/* report entity e, which this worker ran, with its share of the */
+/* protocol's state                                               */
+static void reportentity(int e)
+{
+    size_t v, n;
+
+    for (v = 0; v < sizeof(protocolState) / sizeof(protocolState[0]); v++)
+    {
+        n = protocolState[v].size / NUM_ENTITIES;
+        memcpy((char *)S->workerprotocol + protocolState[v].offset + e * n,
+               (char *)P + protocolState[v].offset + e * n, n);
+    }
+    S->entitystats[e].ndelivered = S->ndelivered[e];
+    S->entitystats[e].filercvd = S->filercvd[e];
+    S->entitystats[e].rcvdhash = S->rcvdhash[e];
+    S->entitystats[e].vsent = S->vsent[e];
+    S->entitystats[e].verify = S->verify[e];
+}
+
+/* add up what the workers reported */
+static void collectstats(void)
+{
+    struct workerstats total;
+    size_t v;
+    int w, e;
+
+    memset(&total, 0, sizeof(total));
+    for (w = 0; w < S->nworkers; w++)
+    {
+        total.nsim += S->workerstats[w].nsim;
+        total.ntolayer3 += S->workerstats[w].ntolayer3;
+        total.nlost += S->workerstats[w].nlost;
+        total.ncorrupt += S->workerstats[w].ncorrupt;
+        total.nsyscalls += S->workerstats[w].nsyscalls;
+        total.nsenddrop += S->workerstats[w].nsenddrop;
+        total.nlatency += S->workerstats[w].nlatency;
+        total.nuntimed += S->workerstats[w].nuntimed;
+        total.nqueuedrop += S->workerstats[w].nqueuedrop;
+        total.nreordered += S->workerstats[w].nreordered;
+        total.nprocessed += S->workerstats[w].nprocessed;
+        total.latencysum += S->workerstats[w].latencysum;
+        for (e = 0; e < LATENCY_BUCKETS; e++)
+            total.latencyhist[e] += S->workerstats[w].latencyhist[e];
+    }
+    S->nsim = total.nsim;
+    S->ntolayer3 = total.ntolayer3;
+    S->nlost = total.nlost;
+    S->ncorrupt = total.ncorrupt;
+    S->nsyscalls = total.nsyscalls;
+    S->nsenddrop = total.nsenddrop;
+    S->nlatency = total.nlatency;
+    S->nuntimed = total.nuntimed;
+    S->nqueuedrop = total.nqueuedrop;
+    S->nreordered = total.nreordered;
+    S->nprocessed = total.nprocessed;
+    S->latencysum = total.latencysum;
+    memcpy(S->latencyhist, total.latencyhist, sizeof(S->latencyhist));
+    for (e = 0; e < NUM_ENTITIES; e++)
+    {
+        S->ndelivered[e] = S->entitystats[e].ndelivered;
+        S->filercvd[e] = S->entitystats[e].filercvd;
+        S->rcvdhash[e] = S->entitystats[e].rcvdhash;
+        S->vsent[e] = S->entitystats[e].vsent;
+        S->verify[e] = S->entitystats[e].verify;
+    }
+    for (v = 0; v < sizeof(protocolState) / sizeof(protocolState[0]); v++)
+        memcpy((char *)P + protocolState[v].offset, (char *)S->workerprotocol + protocolState[v].offset,
+               protocolState[v].size);
+    munmap(S->entitystats, NUM_ENTITIES * sizeof(struct entitystats));
+    munmap(S->workerprotocol, sizeof(struct protocolstate));
+}
+
+/************************ SOCKETS *****************/
+
+/* set time to the wall clock time since the socket run started */
+static void sockettime(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    S->now = TICKS(((now.tv_sec - S->socketstart.tv_sec) * 1e6 + (now.tv_nsec - S->socketstart.tv_nsec) / 1e3) /
+                 S->usecperunit);
+}
+
+/* move timer heap entry i up or down until the heap is in order again */
+static void timersift(int i)
+{
+    int e = S->timerheap[i], c;
+
+    while (i > 0 && S->timerdeadline[S->timerheap[(i - 1) / 2]] > S->timerdeadline[e])
+    {
+        S->timerheap[i] = S->timerheap[(i - 1) / 2];
+        S->timerpos[S->timerheap[i]] = i;
+        i = (i - 1) / 2;
+    }
+    while ((c = 2 * i + 1) < S->ntimers)
+    {
+        if (c + 1 < S->ntimers && S->timerdeadline[S->timerheap[c + 1]] < S->timerdeadline[S->timerheap[c]])
+            c++;
+        if (S->timerdeadline[S->timerheap[c]] >= S->timerdeadline[e])
+            break;
+        S->timerheap[i] = S->timerheap[c];
+        S->timerpos[S->timerheap[i]] = i;
+        i = c;
+    }
+    S->timerheap[i] = e;
+    S->timerpos[e] = i;
+}
+
+/* take AorB's timer out of the heap */
+static void timerremove(int AorB)
+{
+    int i = S->timerpos[AorB];
+
+    S->timerpos[AorB] = -1;
+    if (--S->ntimers > i)
+    {
+        S->timerheap[i] = S->timerheap[S->ntimers];
+        timersift(i);
+    }
+}
+
+/* start AorB's timer going off after increment time units, or stop it */
+/* if increment is 0                                                    */
+static void armtimer(int AorB, float increment)
+{
+    if (increment > 0 && S->timerpos[AorB] >= 0)
+    {
+        printf("Warning: attempt to start a timer that is already started\n");
+        return;
+    }
+    if (increment == 0 && S->timerpos[AorB] < 0)
+    {
+        printf("Warning: unable to cancel your timer. It wasn't running.\n");
+        return;
+    }
+    if (increment == 0)
+    {
+        timerremove(AorB);
+        return;
+    }
+    S->timerdeadline[AorB] = S->now + TICKS(increment);
+    S->timerheap[S->ntimers++] = AorB;
+    timersift(S->ntimers - 1);
+}
+
+/* make timerfd go off by the soonest deadline in the heap.  It is left */
+/* alone when a stopped timer made it early; it just wakes us for nothing */
+static void timerrearm(void)
+{
+    struct itimerspec its;
+    double usec;
+
+    if (S->ntimers == 0 || (S->timerset != 0 && S->timerset <= S->timerdeadline[S->timerheap[0]]))
+        return;
+    S->timerset = S->timerdeadline[S->timerheap[0]];
+    usec = UNITS(S->timerset) * S->usecperunit + S->socketstart.tv_nsec / 1e3;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = S->socketstart.tv_sec + (time_t)(usec / 1e6);
+    its.it_value.tv_nsec = (long)((usec - (time_t)(usec / 1e6) * 1e6) * 1e3);
+    timerfd_settime(S->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+    S->nsyscalls++;
+}
+
+/* send the packets queued on a side's socket */
+static void socketflush(int side)
+{
+    struct mmsghdr msgs[SOCKET_BATCH];
+    struct iovec iov[SOCKET_BATCH];
+    int i, n, sent = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < S->noutbatch[side]; i++)
+    {
+        iov[i].iov_base = &S->outbatch[side][i];
+        iov[i].iov_len = sizeof(struct wirepkt);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &S->sockaddr[side ^ 1];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    while (sent < S->noutbatch[side])
+    {
+        n = sendmmsg(S->sockfd[S->worker][side], msgs + sent, S->noutbatch[side] - sent, 0);
+        S->nsyscalls++;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) /* the socket buffer is full: the rest are lost */
+        {
+            S->nsenddrop += S->noutbatch[side] - sent;
+            break;
+        }
+        sent += n;
+    }
+    S->noutbatch[side] = 0;
+}
+
+/* queue a packet from AorB for its peer on the other side */
+static void socketsend(int AorB, struct pkt *packet)
+{
+    int side = AorB % 2;
+
+    if (S->noutbatch[side] == SOCKET_BATCH)
+        socketflush(side);
+    S->outbatch[side][S->noutbatch[side]].conn = htonl(AorB / 2);
+    S->outbatch[side][S->noutbatch[side]].pkt = *packet;
+    S->noutbatch[side]++;
+}
+
+/* give entity e messages for as long as it takes them, up to its */
+/* flow's share of the budget, so that no flow starves the others  */
+static void socketfeed(int e)
+{
+    if (e % 2 == A || BIDIRECTIONAL)
+    {
+        while (S->flowbudget[e / 2] > 0 && layer4ready(e) && (!FILE_TRANSFER || S->filesent[e] < S->filesize))
+        {
+            S->flowbudget[e / 2]--;
+            givemessage(e);
+        }
+    }
+}
+
+/* pass everything waiting on a side's socket up to the protocol */
+static void socketreceive(int side)
+{
+    struct mmsghdr msgs[SOCKET_BATCH];
+    struct iovec iov[SOCKET_BATCH];
+    struct wirepkt in[SOCKET_BATCH];
+    uint32_t flow;
+    long before;
+    int i, n, e;
+
+    do
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < SOCKET_BATCH; i++)
+        {
+            iov[i].iov_base = &in[i];
+            iov[i].iov_len = sizeof(struct wirepkt);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(S->sockfd[S->worker][side], msgs, SOCKET_BATCH, MSG_DONTWAIT, NULL);
+        S->nsyscalls++;
+        for (i = 0; i < n; i++)
+        {
+            flow = ntohl(in[i].conn);
+            if (msgs[i].msg_len != sizeof(struct wirepkt) || flow >= NUM_FLOWS || (int)(flow % S->nworkers) != S->worker)
+                continue; /* not one of ours */
+            e = ENTITY(flow, side);
+            before = S->ndelivered[e];
+            if (side == A)
+                A_input(flow, in[i].pkt);
+            else
+                B_input(flow, in[i].pkt);
+            S->nsockdelivered += S->ndelivered[e] - before;
+            socketfeed(e);
+        }
+    } while (n == SOCKET_BATCH);
+}
+
+/* call the timer interrupts that are due */
+static void sockettimers(void)
+{
+    uint64_t expired;
+    int e;
+
+    S->nsyscalls++;
+    if (read(S->timerfd, &expired, sizeof(expired)) == sizeof(expired))
+        S->timerset = 0;
+    while (S->ntimers > 0 && S->timerdeadline[S->timerheap[0]] <= S->now)
+    {
+        e = S->timerheap[0];
+        timerremove(e);
+        if (e % 2 == A)
+            A_timerinterrupt(e / 2);
+        else
+            B_timerinterrupt(e / 2);
+        socketfeed(e);
+    }
+}
+
+/* one worker's event loop over the connections it owns */
+static void socketworker(void)
+{
+    struct epoll_event ev, evs[3];
+    long lastdelivered = 0;
+    simtime lastprogress;
+    int i, n, e, flow;
+
+    S->epfd = epoll_create1(0);
+    S->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (S->epfd < 0 || S->timerfd < 0)
+    {
+        printf("Unable to create the worker's epoll and timer descriptors\n");
+        exit(1);
+    }
+    for (i = 0; i < 3; i++)
+    {
+        ev.events = EPOLLIN;
+        ev.data.u32 = i; /* A, B or the timer */
+        epoll_ctl(S->epfd, EPOLL_CTL_ADD, i < 2 ? S->sockfd[S->worker][i] : S->timerfd, &ev);
+    }
+    S->timerset = 0;
+    S->ntimers = 0;
+    S->budget = 0;
+    S->nsyscalls = S->nsenddrop = S->nsockdelivered = 0;
+    S->noutbatch[A] = S->noutbatch[B] = 0;
+    for (e = 0; e < NUM_ENTITIES; e++)
+        S->timerpos[e] = -1;
+    for (flow = S->worker; flow < NUM_FLOWS; flow += S->nworkers)
+    {
+        S->flowbudget[flow] = S->nsimmax / NUM_FLOWS + (flow < S->nsimmax % NUM_FLOWS);
+        S->budget += S->flowbudget[flow];
+    }
+
+    sockettime();
+    lastprogress = S->now;
+    for (flow = S->worker; flow < NUM_FLOWS; flow += S->nworkers)
+    {
+        socketfeed(ENTITY(flow, A));
+        socketfeed(ENTITY(flow, B));
+    }
+    while (1)
+    {
+        for (i = 0; i < 2; i++)
+            if (S->noutbatch[i] > 0)
+                socketflush(i);
+        timerrearm();
+
+        if (S->nsim == S->budget && S->nsockdelivered >= S->budget)
+            break;
+        if (S->nsockdelivered > lastdelivered)
+        {
+            lastdelivered = S->nsockdelivered;
+            lastprogress = S->now;
+        }
+        else if (UNITS(S->now - lastprogress) * S->usecperunit > SOCKET_STALL * 1e6)
+        {
+            printf(" Worker %d: no delivery for %d s, giving up\n", S->worker, SOCKET_STALL);
+            break;
+        }
+
+        n = epoll_wait(S->epfd, evs, 3, 1000);
+        S->nsyscalls++;
+        sockettime();
+        for (i = 0; i < n; i++)
+            if (evs[i].data.u32 < 2)
+                socketreceive(evs[i].data.u32);
+            else
+                sockettimers();
+    }
+    close(S->epfd);
+    close(S->timerfd);
+
+    reportworker(S->nsockdelivered, &S->socketstart);
+    for (e = 0; e < NUM_ENTITIES; e++)
+        if (e / 2 % S->nworkers == S->worker)
+            reportentity(e);
+}
+
+/* open every worker's socket on side, in worker order so that a       */
+/* worker's place in the SO_REUSEPORT group is its number, and have the */
+/* kernel pick the socket by connection id                              */
+static void socketopen(int side)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, 0}, /* A = connection id */
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, S->nworkers},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {3, code};
+    socklen_t len = sizeof(S->sockaddr[side]);
+    int w, on = 1, size = 1 << 22;
+
+    memset(&S->sockaddr[side], 0, sizeof(S->sockaddr[side]));
+    S->sockaddr[side].sin_family = AF_INET;
+    S->sockaddr[side].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (w = 0; w < S->nworkers; w++)
+    {
+        S->sockfd[w][side] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (S->sockfd[w][side] < 0 ||
+            setsockopt(S->sockfd[w][side], SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+            bind(S->sockfd[w][side], (struct sockaddr *)&S->sockaddr[side], len) < 0 ||
+            getsockname(S->sockfd[w][side], (struct sockaddr *)&S->sockaddr[side], &len) < 0)
+        {
+            printf("Unable to open a UDP socket on 127.0.0.1\n");
+            exit(1);
+        }
+        setsockopt(S->sockfd[w][side], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(S->sockfd[w][side], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    if (S->nworkers > 1 &&
+        setsockopt(S->sockfd[0][side], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+    {
+        printf("Unable to attach the connection steering program\n");
+        exit(1);
+    }
+}
+
+/* run the protocol over loopback UDP until nsimmax messages have been */
+/* generated and delivered, or no more are getting through             */
+static void socketrun(void)
+{
+    struct timespec end;
+    int w;
+
+    socketopen(A);
+    socketopen(B);
+    mapstats();
+
+    fflush(stdout); /* or the workers print it again */
+    clock_gettime(CLOCK_MONOTONIC, &S->socketstart);
+    runworkers(socketworker);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    S->wallseconds = (end.tv_sec - S->socketstart.tv_sec) + (end.tv_nsec - S->socketstart.tv_nsec) / 1e9;
+    sockettime();
+
+    for (w = 0; w < S->nworkers; w++)
+    {
+        close(S->sockfd[w][A]);
+        close(S->sockfd[w][B]);
+    }
+    collectstats();
+}
+
+/* throughput and system call cost of the last socket run */
+static void printsocketstats(void)
+{
+    long delivered = 0;
+    int w;
+
+    for (w = 0; w < S->nworkers; w++)
+    {
+        delivered += S->workerstats[w].ndelivered;
+        if (S->nworkers > 1)
+            printf(" worker %d: %ld msgs delivered in %.3f s, %.0f msgs/sec\n", w, S->workerstats[w].ndelivered,
+                   S->workerstats[w].seconds,
+                   S->workerstats[w].seconds > 0 ? S->workerstats[w].ndelivered / S->workerstats[w].seconds : 0.0);
+    }
+    printf(" %d connections on %d workers: %ld msgs delivered over UDP in %.3f s, %.0f msgs/sec\n", NUM_FLOWS,
+           S->nworkers, delivered, S->wallseconds, S->wallseconds > 0 ? delivered / S->wallseconds : 0.0);
+    printf(" %ld system calls, %.2f per message; %ld packets lost, %ld corrupted, %ld refused by the kernel\n",
+           S->nsyscalls, delivered > 0 ? (double)S->nsyscalls / delivered : 0.0, S->nlost, S->ncorrupt, S->nsenddrop);
+    munmap(S->workerstats, MAX_WORKERS * sizeof(struct workerstats));
+}
+
+/************************ THREADS *****************/
+
+/* put a packet for or from entity on r, stamped with time; false if r */
+/* is full                                                             */
+static bool ringput(struct ring *r, int entity, struct pkt *pkt, simtime time)
+{
+    long tail = r->tail;
+
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+        return false;
+    r->slot[tail % RING_SIZE].entity = entity;
+    r->slot[tail % RING_SIZE].time = time;
+    r->slot[tail % RING_SIZE].pkt = *pkt;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* the oldest packet on r, or NULL if it is empty; it stays there until */
+/* ringpop()                                                            */
+static struct ringpkt *ringpeek(struct ring *r)
+{
+    long head = r->head;
+
+    return head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ? NULL : &r->slot[head % RING_SIZE];
+}
+
+static void ringpop(struct ring *r)
+{
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* read the wall clock into threadtime */
+static simtime threadclock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return threadtime = TICKS(((now.tv_sec - S->threadstart.tv_sec) * 1e6 + (now.tv_nsec - S->threadstart.tv_nsec) / 1e3) /
+                              S->usecperunit);
+}
+
+/* sleep until deadline, but no more than THREAD_POLL microseconds */
+static void threadwait(simtime deadline)
+{
+    struct timespec ts = {0, THREAD_POLL * 1000};
+    double usec = UNITS(deadline - threadtime) * S->usecperunit;
+
+    if (usec <= 0)
+        return;
+    if (usec < THREAD_POLL)
+        ts.tv_nsec = (long)(usec * 1000);
+    nanosleep(&ts, NULL);
+}
+
+/* start AorB's timer going off after increment time units, or stop it */
+/* if increment is 0.  The sides hand the senders messages as fast as   */
+/* they take them and the threads run late, so the real round trip can */
+/* be far longer than the protocol's timeout allows for; a timer lasts  */
+/* at least twice the round trip as lately measured, as in RFC 793     */
+static void threadtimer(int AorB, float increment)
+{
+    simtime rtt = __atomic_load_n(&S->sidetransit[A], __ATOMIC_RELAXED) +
+                  __atomic_load_n(&S->sidelag[B], __ATOMIC_RELAXED) +
+                  __atomic_load_n(&S->sidetransit[B], __ATOMIC_RELAXED) +
+                  __atomic_load_n(&S->sidelag[A], __ATOMIC_RELAXED);
+
+    if (increment > 0 && S->timerdeadline[AorB] != SIMTIME_MAX)
+    {
+        printf("Warning: attempt to start a timer that is already started\n");
+        return;
+    }
+    if (increment == 0 && S->timerdeadline[AorB] == SIMTIME_MAX)
+    {
+        printf("Warning: unable to cancel your timer. It wasn't running.\n");
+        return;
+    }
+    if (increment == 0)
+        S->timerdeadline[AorB] = SIMTIME_MAX;
+    else
+        S->timerdeadline[AorB] = threadtime + (TICKS(increment) > 2 * rtt ? TICKS(increment) : 2 * rtt);
+    if (S->timerdeadline[AorB] < S->sidenext[AorB % 2])
+        S->sidenext[AorB % 2] = S->timerdeadline[AorB]; /* a stopped one leaves it early */
+}
+
+/* call the timer interrupts on side that are due, and find the next one */
+static void threadtimers(int side)
+{
+    int e;
+
+    for (e = side; e < NUM_ENTITIES; e += 2)
+        if (S->timerdeadline[e] <= threadtime)
+        {
+            S->timerdeadline[e] = SIMTIME_MAX;
+            if (side == A)
+                A_timerinterrupt(e / 2);
+            else
+                B_timerinterrupt(e / 2);
+            threadfeed(e);
+        }
+    S->sidenext[side] = SIMTIME_MAX;
+    for (e = side; e < NUM_ENTITIES; e += 2)
+        if (S->timerdeadline[e] < S->sidenext[side])
+            S->sidenext[side] = S->timerdeadline[e];
+}
+
+/* give entity e messages for as long as it takes them */
+static void threadfeed(int e)
+{
+    int side = e % 2;
+
+    if (side == A || BIDIRECTIONAL)
+        while (S->sidegenerated[side] < S->sidebudget[side] && layer4ready(e))
+        {
+            S->sidegenerated[side]++;
+            givemessage(e);
+        }
+}
+
+/* the thread that calls every entity on one side */
+static void *sidethread(void *arg)
+{
+    int side = (int)(long)arg, e;
+    struct ringpkt *r;
+    struct timespec cpu;
+    long delivered = 0, before;
+    simtime lag;
+
+    threadclock();
+    for (e = side; e < NUM_ENTITIES; e += 2)
+        threadfeed(e);
+    while (!__atomic_load_n(&S->threadsstop, __ATOMIC_ACQUIRE))
+    {
+        threadclock();
+        while ((r = ringpeek(&S->frommedium[side])) != NULL)
+        {
+            e = r->entity;
+            lag = threadtime > r->time ? threadtime - r->time : 0;
+            __atomic_store_n(&S->sidelag[side], S->sidelag[side] + (lag - S->sidelag[side]) / 8, __ATOMIC_RELAXED);
+            before = S->ndelivered[e];
+            if (side == A)
+                A_input(e / 2, r->pkt);
+            else
+                B_input(e / 2, r->pkt);
+            ringpop(&S->frommedium[side]);
+            delivered += S->ndelivered[e] - before;
+            threadfeed(e);
+        }
+        __atomic_store_n(&S->sidedelivered[side], delivered, __ATOMIC_RELEASE);
+        if (S->sidenext[side] <= threadtime)
+            threadtimers(side);
+        threadwait(S->sidenext[side]);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    S->threadcpu[side] = cpu.tv_sec + cpu.tv_nsec / 1e9;
+    return NULL;
+}
+
+/* the medium's thread: take in what the sides send, and pass each packet */
+/* on once the wall clock reaches its arrival time                         */
+static void *mediumthread(void *arg __attribute__((unused)))
+{
+    struct ringpkt *r;
+    struct event *p;
+    struct timespec cpu;
+    int side;
+
+    inmedium = true;
+    while (!__atomic_load_n(&S->threadsstop, __ATOMIC_ACQUIRE))
+    {
+        S->now = threadclock();
+        for (side = 0; side < 2; side++)
+            while ((r = ringpeek(&S->tomedium[side])) != NULL)
+            {
+                tolayer3(r->entity, r->pkt);
+                ringpop(&S->tomedium[side]);
+            }
+        while ((p = peekevent()) != NULL && p->evtime <= S->now &&
+               ringput(&S->frommedium[p->eventity % 2], p->eventity, p->pktptr, p->evtime))
+        {
+            nextevent();
+            S->ninflight--;
+            free(p->pktptr);
+            free(p);
+        }
+        threadwait(p != NULL ? p->evtime : SIMTIME_MAX);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    S->threadcpu[2] = cpu.tv_sec + cpu.tv_nsec / 1e9;
+    return NULL;
+}
+
+/* run the protocol in real time on the A, B and medium threads until   */
+/* nsimmax messages have been generated and delivered, or no more are   */
+/* getting through                                                       */
+static void threadrun(void)
+{
+    int senders = BIDIRECTIONAL ? NUM_ENTITIES : NUM_FLOWS;
+    pthread_t tid[3];
+    long delivered, lastdelivered = -1;
+    simtime lastprogress = 0;
+    struct timespec tick = {0, 1000000};
+    struct event *p;
+    int e, i;
+
+    while ((p = nextevent()) != NULL) /* the sides generate their own messages */
+        free(p);
+    memset(S->tomedium, 0, sizeof(S->tomedium));
+    memset(S->frommedium, 0, sizeof(S->frommedium));
+    for (i = 0; i < 2; i++)
+        S->sidebudget[i] = S->sidegenerated[i] = S->sidedelivered[i] = S->nringdrop[i] = 0;
+    for (e = 0; e < NUM_ENTITIES; e++)
+    {
+        S->timerdeadline[e] = SIMTIME_MAX;
+        if (e % 2 == A || BIDIRECTIONAL)
+        {
+            i = BIDIRECTIONAL ? e : e / 2;
+            S->sidebudget[e % 2] += S->nsimmax / senders + (i < S->nsimmax % senders);
+        }
+    }
+    S->sidenext[A] = S->sidenext[B] = SIMTIME_MAX;
+    S->sidetransit[A] = S->sidetransit[B] = S->sidelag[A] = S->sidelag[B] = 0;
+    S->threadsstop = false;
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &S->threadstart);
+    pthread_create(&tid[2], NULL, mediumthread, NULL);
+    pthread_create(&tid[A], NULL, sidethread, (void *)(long)A);
+    pthread_create(&tid[B], NULL, sidethread, (void *)(long)B);
+    while (1)
+    {
+        nanosleep(&tick, NULL);
+        threadclock();
+        delivered = __atomic_load_n(&S->sidedelivered[A], __ATOMIC_ACQUIRE) +
+                    __atomic_load_n(&S->sidedelivered[B], __ATOMIC_ACQUIRE);
+        if (delivered >= S->nsimmax)
+            break;
+        if (delivered > lastdelivered)
+        {
+            lastdelivered = delivered;
+            lastprogress = threadtime;
+        }
+        else if (UNITS(threadtime - lastprogress) * S->usecperunit > THREAD_STALL * 1e6)
+        {
+            printf(" No delivery for %d s, giving up\n", THREAD_STALL);
+            break;
+        }
+    }
+    __atomic_store_n(&S->threadsstop, true, __ATOMIC_RELEASE);
+    for (i = 0; i < 3; i++)
+        pthread_join(tid[i], NULL);
+    S->now = threadclock();
+}
+
+/* throughput and CPU cost of the last threaded run */
+static void printthreadstats(void)
+{
+    double seconds = UNITS(S->now) * S->usecperunit / 1e6;
+    long delivered = S->sidedelivered[A] + S->sidedelivered[B];
+
+    printf(" %ld msgs delivered in %.3f s, %.0f msgs/sec; %ld packets a full ring refused\n", delivered, seconds,
+           seconds > 0 ? delivered / seconds : 0.0, S->nringdrop[A] + S->nringdrop[B]);
+    printf(" CPU seconds: A %.3f, B %.3f, medium %.3f; %.2f us of protocol CPU per msg delivered\n", S->threadcpu[A],
+           S->threadcpu[B], S->threadcpu[2], delivered > 0 ? (S->threadcpu[A] + S->threadcpu[B]) * 1e6 / delivered : 0.0);
+}
+
+/************************ PARALLEL SIMULATION *****************/
+
+/* what each partition keeps for itself; the per-entity state needs no */
+/* copying, as only the partition an entity is on touches it           */
+static struct statevar partitionState[] = {
+    STATEVAR(struct simstate, now),
+    STATEVAR(struct simstate, nsim),
+    STATEVAR(struct simstate, nsimmax),
+    STATEVAR(struct simstate, evlist),
+    STATEVAR(struct simstate, nevents),
+    STATEVAR(struct simstate, evlistsize),
+    STATEVAR(struct simstate, nextevseq),
+    STATEVAR(struct simstate, wheel),
+    STATEVAR(struct simstate, wheelmap),
+    STATEVAR(struct simstate, wheelnow),
+    STATEVAR(struct simstate, nwheel),
+    STATEVAR(struct simstate, wheelnext),
+    STATEVAR(struct simstate, wheelstale),
+    STATEVAR(struct simstate, idtimers),
+    STATEVAR(struct simstate, freeids),
+    STATEVAR(struct simstate, nidtimers),
+    STATEVAR(struct simstate, nfreeids),
+    STATEVAR(struct simstate, idtimersize),
+    STATEVAR(struct simstate, rngstate),
+    STATEVAR(struct simstate, linkfree),
+    STATEVAR(struct simstate, queuedepart),
+    STATEVAR(struct simstate, queuehead),
+    STATEVAR(struct simstate, queuelen),
+    STATEVAR(struct simstate, channel),
+};
+
+/* make partition p's state the current one */
+static void swapin(int p)
+{
+    char *s = S->partsave[p];
+    size_t v;
+
+    for (v = 0; v < sizeof(partitionState) / sizeof(partitionState[0]); v++)
+    {
+        memcpy((char *)S + partitionState[v].offset, s, partitionState[v].size);
+        s += partitionState[v].size;
+    }
+    S->partition = p;
+}
+
+/* put the current state away as partition p's */
+static void swapout(int p)
+{
+    char *s = S->partsave[p];
+    size_t v;
+
+    for (v = 0; v < sizeof(partitionState) / sizeof(partitionState[0]); v++)
+    {
+        memcpy(s, (char *)S + partitionState[v].offset, partitionState[v].size);
+        s += partitionState[v].size;
+    }
+}
+
+/* messages the senders on endpoint p generate between them */
+static int partitionbudget(int p)
+{
+    int senders = BIDIRECTIONAL ? NUM_ENTITIES : NUM_FLOWS;
+    int e, i, n = 0;
+
+    for (e = 0; e < NUM_ENTITIES; e++)
+        if ((e % 2 == A || BIDIRECTIONAL) && flowendpoint(e) == p)
+        {
+            i = BIDIRECTIONAL ? e : e / 2;
+            n += S->nsimmax / senders + (i < S->nsimmax % senders);
+        }
+    return n;
+}
+
+/* set partition p up at time 0, to generate budget messages */
+static void startpartition(int p, int budget)
+{
+    size_t v;
+    int i, size = 0;
+
+    for (v = 0; v < sizeof(partitionState) / sizeof(partitionState[0]); v++)
+        size += partitionState[v].size;
+    S->partsave[p] = (char *)malloc(size);
+    S->partition = p;
+    newevlist();
+    S->now = 0;
+    S->nsim = 0;
+    S->nsimmax = budget;
+    seedrandom((unsigned)S->runseed * NUM_ENDPOINTS + p);
+    for (i = 0; i < 2; i++)
+    {
+        S->linkfree[i] = 0;
+        S->queuehead[i] = S->queuelen[i] = 0;
+        S->channel[i].nbad = 0;
+        if (CHANNEL_MODEL == GILBERT_ELLIOTT)
+            enterstate(&S->channel[i], 0);
+    }
+    for (i = 0; i < NUM_ENTITIES; i++)
+        if ((i % 2 == A || BIDIRECTIONAL) && flowendpoint(i) == p)
+        {
+            if (TRAFFIC == ONOFF)
+                S->onuntil[i] = TICKS(exponential(S->ontime));
+            generate_next_arrival(i);
+        }
+    swapout(p);
+}
+
+/* hand a packet arrival to the partition it happens in */
+static void mailsend(struct event *evptr)
+{
+    struct mailbox *mb = &S->shared->mail[S->partition][flowendpoint(evptr->eventity)];
+    struct mailevent *m;
+    long tail = mb->tail;
+
+    if (tail - __atomic_load_n(&mb->head, __ATOMIC_ACQUIRE) == MAILBOX_SIZE)
+    {
+        printf("Partition %d's mailbox is full, raise MAILBOX_SIZE\n", S->partition);
+        fflush(stdout);
+        kill(0, SIGTERM); /* the other workers would wait for this one forever */
+    }
+    m = &mb->ev[tail % MAILBOX_SIZE];
+    m->evtime = evptr->evtime;
+    m->eventity = evptr->eventity;
+    m->order = evptr->order;
+    m->pkt = *evptr->pktptr;
+    __atomic_store_n(&mb->tail, tail + 1, __ATOMIC_RELEASE);
+    free(evptr->pktptr);
+    free(evptr);
+}
+
+/* move the packets mailed to the current partition into its event */
+/* list, taking the senders in order so the result does not depend  */
+/* on which worker got there first                                  */
+static void mailreceive(void)
+{
+    struct mailbox *mb;
+    struct event *evptr;
+    long head, tail;
+    int q;
+
+    for (q = 0; q < NUM_ENDPOINTS; q++)
+    {
+        mb = &S->shared->mail[q][S->partition];
+        tail = __atomic_load_n(&mb->tail, __ATOMIC_ACQUIRE);
+        for (head = mb->head; head < tail; head++)
+        {
+            evptr = (struct event *)malloc(sizeof(struct event));
+            evptr->evtype = FROM_LAYER3;
+            evptr->evtime = mb->ev[head % MAILBOX_SIZE].evtime;
+            evptr->eventity = mb->ev[head % MAILBOX_SIZE].eventity;
+            evptr->order = mb->ev[head % MAILBOX_SIZE].order;
+            evptr->pktptr = (struct pkt *)malloc(sizeof(struct pkt));
+            *evptr->pktptr = mb->ev[head % MAILBOX_SIZE].pkt;
+            insertevent(evptr);
+        }
+        __atomic_store_n(&mb->head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* one worker's share of the partitions, simulated window by window */
+static void parallelworker(void)
+{
+    struct timespec start;
+    simtime from, last = 0;
+    long delivered = 0;
+    int p, e, spent, n = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    S->nwindows = S->nprocessed = 0;
+    while (1)
+    {
+        for (p = S->worker; p < NUM_ENDPOINTS; p += S->nworkers)
+        {
+            swapin(p);
+            mailreceive();
+            S->shared->next[p] = peekevent() != NULL ? peekevent()->evtime : SIMTIME_MAX;
+            S->shared->spent[p] = S->nsim == S->nsimmax;
+            swapout(p);
+        }
+        pthread_barrier_wait(&S->shared->barrier);
+
+        from = SIMTIME_MAX;
+        spent = 0;
+        for (p = 0; p < NUM_ENDPOINTS; p++)
+        {
+            if (S->shared->next[p] < from)
+                from = S->shared->next[p];
+            spent += S->shared->spent[p];
+        }
+        if (from == SIMTIME_MAX || spent == NUM_ENDPOINTS)
+            break;
+        S->nwindows++;
+        for (p = S->worker; p < NUM_ENDPOINTS; p += S->nworkers)
+        {
+            swapin(p);
+            simulate(from + S->lookahead);
+            swapout(p);
+        }
+        pthread_barrier_wait(&S->shared->barrier);
+    }
+
+    for (p = S->worker; p < NUM_ENDPOINTS; p += S->nworkers)
+    {
+        swapin(p);
+        n += S->nsim;
+        if (S->now > last)
+            last = S->now;
+    }
+    S->nsim = n;
+    S->now = last;
+    for (e = 0; e < NUM_ENTITIES; e++)
+        if (flowendpoint(e) % S->nworkers == S->worker)
+        {
+            delivered += S->ndelivered[e];
+            reportentity(e);
+        }
+    reportworker(delivered, &start);
+}
+
+/* run the partitions on nworkers worker processes until every sender */
+/* has generated its share of the messages                             */
+static void parallelrun(void)
+{
+    pthread_barrierattr_t attr;
+    struct event *q;
+    struct timespec start, end;
+    int budget[NUM_ENDPOINTS];
+    int p, w, total = S->nsimmax;
+
+    S->lookahead = LINK_MODEL ? TICKS(sizeof(struct pkt) / S->linkrate) + TICKS(S->propdelay) : TICKS(1);
+    if (S->lookahead <= 0)
+    {
+        printf("PARALLEL needs every packet to take some time to arrive\n");
+        exit(1);
+    }
+    S->shared = (struct parallelshared *)mmap(NULL, sizeof(struct parallelshared), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (S->shared == MAP_FAILED)
+    {
+        printf("Unable to map the partition mailboxes\n");
+        exit(1);
+    }
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&S->shared->barrier, &attr, S->nworkers);
+
+    while ((q = nextevent()) != NULL) /* startrun's arrivals are not used */
+        free(q);
+    free(S->evlist);
+    for (p = 0; p < NUM_ENDPOINTS; p++)
+        budget[p] = partitionbudget(p);
+    for (p = 0; p < NUM_ENDPOINTS; p++)
+        startpartition(p, budget[p]);
+    mapstats();
+
+    fflush(stdout); /* or the workers print it again */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    runworkers(parallelworker);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    S->wallseconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (p = 0; p < NUM_ENDPOINTS; p++) /* free what is left of the partitions here */
+    {
+        swapin(p);
+        while ((q = nextevent()) != NULL)
+        {
+            if (q->evtype == FROM_LAYER3)
+                free(q->pktptr);
+            free(q);
+        }
+        free(S->evlist);
+        free(S->partsave[p]);
+    }
+    S->evlist = NULL;
+    S->nevents = S->evlistsize = 0;
+    collectstats();
+    S->nsimmax = total;
+    S->now = 0;
+    for (w = 0; w < S->nworkers; w++)
+        if (S->workerstats[w].time > S->now)
+            S->now = S->workerstats[w].time;
+    S->nwindows = S->workerstats[0].nwindows; /* the same for every worker */
+    pthread_barrier_destroy(&S->shared->barrier);
+    munmap(S->shared, sizeof(struct parallelshared));
+}
+
+/* how the parallel run went */
+static void printparallelstats(void)
+{
+    int w;
+
+    for (w = 0; w < S->nworkers && S->nworkers > 1; w++)
+        printf(" worker %d: %ld events in %.3f s, %.0f events/sec\n", w, S->workerstats[w].nprocessed,
+               S->workerstats[w].seconds,
+               S->workerstats[w].seconds > 0 ? S->workerstats[w].nprocessed / S->workerstats[w].seconds : 0.0);
+    printf(" %d partitions on %d workers: %ld events in %.3f s, %.0f events/sec\n", NUM_ENDPOINTS, S->nworkers,
+           S->nprocessed, S->wallseconds, S->wallseconds > 0 ? S->nprocessed / S->wallseconds : 0.0);
+    printf(" %ld windows of %f time units\n", S->nwindows, UNITS(S->lookahead));
+    munmap(S->workerstats, MAX_WORKERS * sizeof(struct workerstats));
+}
+
+/************************ TIME SERIES *****************/
+
+/* allocate the columns and open the file the samples go to */
+static void opensamples(void)
+{
+    int n = strlen(S->samplefile), e;
+
+    S->samples = (struct samples *)malloc(sizeof(struct samples));
+    S->samples->nrows = 0;
+    if ((S->samplef = fopen(S->samplefile, "w")) == NULL)
+    {
+        printf("Could not open %s\n", S->samplefile);
+        exit(1);
+    }
+    if (n > 4 && strcmp(S->samplefile + n - 4, ".csv") == 0)
+    {
+        fprintf(S->samplef, "run,time,sent,delivered,goodput");
+        for (e = 0; e < NUM_ENTITIES; e++)
+            fprintf(S->samplef, ",window%d,timers%d", e, e);
+        fprintf(S->samplef, "\n");
+    }
+    else
+    {
+        n = NUM_ENTITIES;
+        fwrite("RDTSMPL1", 8, 1, S->samplef);
+        fwrite(&n, sizeof(n), 1, S->samplef);
+    }
+}
+
+/* write out the samples taken so far.  A binary block is the run and    */
+/* the number of rows, as ints, then each column of struct samples in    */
+/* turn: time, sent, delivered, goodput, then window and timers for each */
+/* entity.                                                                */
+static void flushsamples(void)
+{
+    struct samples *s = S->samples;
+    int run = S->runseed - SEED, n = strlen(S->samplefile), i, e;
+
+    if (n > 4 && strcmp(S->samplefile + n - 4, ".csv") == 0)
+        for (i = 0; i < s->nrows; i++)
+        {
+            fprintf(S->samplef, "%d,%f,%ld,%ld,%f", run, s->time[i], s->sent[i], s->delivered[i], s->goodput[i]);
+            for (e = 0; e < NUM_ENTITIES; e++)
+                fprintf(S->samplef, ",%d,%d", s->window[e][i], s->timers[e][i]);
+            fprintf(S->samplef, "\n");
+        }
+    else if (s->nrows > 0)
+    {
+        fwrite(&run, sizeof(run), 1, S->samplef);
+        fwrite(&s->nrows, sizeof(s->nrows), 1, S->samplef);
+        fwrite(s->time, sizeof(s->time[0]), s->nrows, S->samplef);
+        fwrite(s->sent, sizeof(s->sent[0]), s->nrows, S->samplef);
+        fwrite(s->delivered, sizeof(s->delivered[0]), s->nrows, S->samplef);
+        fwrite(s->goodput, sizeof(s->goodput[0]), s->nrows, S->samplef);
+        for (e = 0; e < NUM_ENTITIES; e++)
+            fwrite(s->window[e], sizeof(s->window[e][0]), s->nrows, S->samplef);
+        for (e = 0; e < NUM_ENTITIES; e++)
+            fwrite(s->timers[e], sizeof(s->timers[e][0]), s->nrows, S->samplef);
+    }
+    S->nsamples += s->nrows;
+    s->nrows = 0;
+}
+
+/* record the state at nextsample, which is no later than the next event */
+static void takesample(void)
+{
+    struct samples *s = S->samples;
+    long delivered = 0;
+    int i, e, row;
+
+    if (s->nrows == SAMPLE_ROWS)
+        flushsamples();
+    row = s->nrows++;
+    for (e = 0; e < NUM_ENTITIES; e++)
+    {
+        delivered += S->ndelivered[e];
+        s->window[e][row] = layer4window(e);
+        s->timers[e][row] = S->timerevent[e] != NULL;
+    }
+    for (i = 0; i < S->nidtimers; i++)
+        if (S->idtimers[i] != NULL)
+            s->timers[S->idtimers[i]->eventity][row]++;
+    s->time[row] = UNITS(S->nextsample);
+    s->sent[row] = S->ntolayer3;
+    s->delivered[row] = delivered;
+    s->goodput[row] = (delivered - S->sampledelivered) / UNITS(S->sampleticks);
+    S->sampledelivered = delivered;
+    S->nextsample += S->sampleticks;
+}
+
+/************************ LIVE METRICS *****************/
+
+/* copy the counters the exporter reports into metrics */
+static void publishmetrics(int run)
+{
+    long delivered = 0;
+    int i;
+
+    for (i = 0; i < NUM_ENTITIES; i++)
+        delivered += S->ndelivered[i];
+    __atomic_store_n(&S->metrics.events, S->nprocessed, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->metrics.queued, (long)(S->nevents + S->nwheel), __ATOMIC_RELAXED);
+    __atomic_store_n(&S->metrics.inflight, S->ninflight, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->metrics.ntolayer3, S->ntolayer3, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->metrics.delivered, delivered, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->metrics.nlost, S->nlost, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->metrics.ncorrupt, S->ncorrupt, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->metrics.time, S->now, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->metrics.run, run, __ATOMIC_RELAXED);
+}
+
+static void printmetric(FILE *f, char *name, char *type, char *help, double value)
+{
+    fprintf(f, "# HELP rdt_%s %s\n# TYPE rdt_%s %s\nrdt_%s %.17g\n", name, help, name, type, name, value);
+}
+
+/* write what metrics holds now; the rate is over the time since the */
+/* last export                                                        */
+static void writemetrics(FILE *f)
+{
+    static long lastevents;
+    static double lastseconds;
+    struct timespec now;
+    double seconds, rate;
+    long events;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    seconds = now.tv_sec + now.tv_nsec / 1e9;
+    events = __atomic_load_n(&S->metrics.events, __ATOMIC_RELAXED);
+    rate = lastseconds > 0 && seconds > lastseconds ? (events - lastevents) / (seconds - lastseconds) : 0.0;
+    lastevents = events;
+    lastseconds = seconds;
+    printmetric(f, "events_total", "counter", "Events simulated.", events);
+    printmetric(f, "events_per_second", "gauge", "Events simulated per second of real time since the last export.",
+                rate);
+    printmetric(f, "simulated_time", "gauge", "Simulated time of the last event, in time units.",
+                UNITS(__atomic_load_n(&S->metrics.time, __ATOMIC_RELAXED)));
+    printmetric(f, "run", "gauge", "Replication being simulated, from 0.", __atomic_load_n(&S->metrics.run, __ATOMIC_RELAXED));
+    printmetric(f, "event_queue_depth", "gauge", "Events waiting to be simulated.",
+                __atomic_load_n(&S->metrics.queued, __ATOMIC_RELAXED));
+    printmetric(f, "packets_in_flight", "gauge", "Packets in the medium.",
+                __atomic_load_n(&S->metrics.inflight, __ATOMIC_RELAXED));
+    printmetric(f, "packets_sent_total", "counter", "Packets sent into layer 3 this run.",
+                __atomic_load_n(&S->metrics.ntolayer3, __ATOMIC_RELAXED));
+    printmetric(f, "messages_delivered_total", "counter", "Messages delivered to layer 5 this run.",
+                __atomic_load_n(&S->metrics.delivered, __ATOMIC_RELAXED));
+    printmetric(f, "packets_lost_total", "counter", "Packets lost by the medium this run.",
+                __atomic_load_n(&S->metrics.nlost, __ATOMIC_RELAXED));
+    printmetric(f, "packets_corrupted_total", "counter", "Packets corrupted by the medium this run.",
+                __atomic_load_n(&S->metrics.ncorrupt, __ATOMIC_RELAXED));
+    S->nexports++;
+}
+
+/* replace the metrics file, through a temporary so readers see all or none */
+static void exportfile(void)
+{
+    char tmp[sizeof(S->metricsdest) + 4];
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", S->metricsdest);
+    if ((f = fopen(tmp, "w")) == NULL)
+        return; /* try again next period */
+    writemetrics(f);
+    fclose(f);
+    rename(tmp, S->metricsdest);
+}
+
+/* the exporter: write the file every metricsperiod seconds, or answer */
+/* each connection to the socket with the current metrics              */
+static void *metricsthread(void *arg)
+{
+    struct pollfd pfd = {(int)(long)arg, POLLIN, 0};
+    double waited = 0.0;
+    int fd;
+    FILE *f;
+
+    while (!__atomic_load_n(&S->metricsstop, __ATOMIC_ACQUIRE))
+    {
+        if (pfd.fd >= 0)
+        {
+            if (poll(&pfd, 1, 100) > 0 && (fd = accept(pfd.fd, NULL, NULL)) >= 0)
+            {
+                if ((f = fdopen(fd, "w")) != NULL)
+                {
+                    fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+                    writemetrics(f);
+                    fclose(f);
+                }
+                else
+                    close(fd);
+            }
+            continue;
+        }
+        usleep(100000);
+        if ((waited += 0.1) >= S->metricsperiod - 0.05)
+        {
+            exportfile();
+            waited = 0.0;
+        }
+    }
+    if (pfd.fd >= 0)
+    {
+        close(pfd.fd);
+        unlink(S->metricsdest + 5);
+    }
+    else
+        exportfile(); /* the final counts */
+    return NULL;
+}
+
+/* open the socket if there is to be one and start the exporter */
+static void startmetrics(void)
+{
+    struct sockaddr_un addr;
+    long fd = -1;
+
+    if (strncmp(S->metricsdest, "unix:", 5) == 0)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(S->metricsdest + 5) >= sizeof(addr.sun_path))
+        {
+            printf("Socket path %s is too long\n", S->metricsdest + 5);
+            exit(1);
+        }
+        strcpy(addr.sun_path, S->metricsdest + 5);
+        unlink(addr.sun_path);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(fd, 8) < 0)
+        {
+            perror("metrics socket");
+            exit(1);
+        }
+    }
+    publishmetrics(0);
+    if (pthread_create(&S->metricsid, NULL, metricsthread, (void *)fd) != 0)
+    {
+        printf("Could not start the metrics exporter\n");
+        exit(1);
+    }
+}
+
+/* have the exporter write the final counts and wait for it */
+static void stopmetrics(void)
+{
+    __atomic_store_n(&S->metricsstop, true, __ATOMIC_RELEASE);
+    pthread_join(S->metricsid, NULL);
+    printf(" %ld metrics exports to %s\n", S->nexports, S->metricsdest);
+}
+
+/************************ LIBRARY *****************/
+
+#if SIM_LIBRARY
+/* a sim is the state of one run; the routines above work on the one */
+/* S and P point at, which each call into the library sets first     */
+struct sim
+{
+    struct simstate state;
+    struct protocolstate protocol;
+};
+
+/* make sim the one the calling thread runs */
+static void simenter(struct sim *sim)
+{
+    S = &sim->state;
+    P = &sim->protocol;
+}
+
+/* printf, unless the sim being run is quiet */
+static int simprintf(const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    if (S->quiet)
+        return 0;
+    va_start(ap, format);
+    n = vprintf(format, ap);
+    va_end(ap);
+    return n;
+}
+
+struct sim *sim_create(struct simconfig *config)
+{
+    struct sim *sim;
+
+    if (SOCKETS || THREADS || PARALLEL || SNAPSHOT || METRICS || SAMPLER || STEADY_STATE || DRAIN || FILE_TRANSFER ||
+        LINK_MODEL || COALESCE || FLOW_CONTROL || CHANNEL_MODEL != BERNOULLI || CHANNEL_ORDER == REORDER ||
+        TRAFFIC == ONOFF || TRAFFIC == TRACE_REPLAY)
+        return NULL; /* these read more parameters at start-up */
+    if (PROFILE)
+        return NULL; /* its counts are the process's, not a sim's */
+    if ((sim = (struct sim *)calloc(1, sizeof(struct sim))) == NULL)
+        return NULL;
+    simenter(sim);
+    newsim();
+    S->nsimmax = config->nsimmax;
+    S->lossprob = config->lossprob;
+    S->corruptprob = config->corruptprob;
+    S->lambda = config->lambda;
+    S->TRACE = config->trace;
+    S->quiet = config->quiet;
+    if (config->timeout > 0)
+        P->timeout = config->timeout;
+    newevlist();
+    startrun(config->seed);
+    A_init();
+    B_init();
+    return sim;
+}
+
+long sim_run(struct sim *sim, long nevents)
+{
+    long start;
+
+    simenter(sim);
+    start = S->nprocessed;
+    if (!S->simdone)
+    {
+        S->eventlimit = S->nprocessed + nevents;
+        simulate(SIMTIME_MAX);
+        S->eventlimit = LONG_MAX;
+    }
+    return S->nprocessed - start;
+}
+
+struct simstats sim_stats(struct sim *sim)
+{
+    struct simstats st;
+    int e;
+
+    simenter(sim);
+    st.time = UNITS(S->now);
+    st.events = S->nprocessed;
+    st.generated = S->nsim;
+    st.delivered = 0;
+    for (e = 0; e < NUM_ENTITIES; e++)
+        st.delivered += S->ndelivered[e];
+    st.sent = S->ntolayer3;
+    st.lost = S->nlost;
+    st.corrupted = S->ncorrupt;
+    st.goodput = goodput();
+    st.latencymedian = latencyquantile(0.5);
+    st.latencyp99 = latencyquantile(0.99);
+    st.done = S->simdone;
+    return st;
+}
+
+void sim_destroy(struct sim *sim)
+{
+    struct event *p;
+
+    simenter(sim);
+    while ((p = nextevent()) != NULL)
+    {
+        if (p->evtype == FROM_LAYER3)
+            free(p->pktptr);
+        free(p);
+    }
+    free(S->evlist);
+    free(S->idtimers);
+    free(S->freeids);
+    S = NULL;
+    P = NULL;
+    free(sim);
+}
+#endif
+
+/********************* EVENT HANDLINE ROUTINES *******/
+/*  The next set of routines handle the event list   */
+/*****************************************************/
+
+/* exponentially distributed time with the given mean */
+static double exponential(float mean)
+{
+    double u;
+    float jimsrand();
+
+    do
+        u = jimsrand();
+    while (u <= 0.0);
+    return -mean * log(u);
+}
+
+/* map the arrival trace in file name for TRACE_REPLAY */
+static void maptrace(char *name)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        printf("Unable to open arrival trace %s\n", name);
+        exit(1);
+    }
+    S->tracelen = st.st_size / sizeof(struct tracerecord);
+    S->tracedata = NULL;
+    if (S->tracelen > 0)
+    {
+        S->tracedata = (struct tracerecord *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (S->tracedata == MAP_FAILED)
+        {
+            printf("Unable to map arrival trace %s\n", name);
+            exit(1);
+        }
+        madvise(S->tracedata, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+/* schedule the next message from layer 5.  entity is the sending entity */
+/* whose message just arrived (or the one to start), for the sources     */
+/* that run one per entity                                               */
+static void generate_next_arrival(int entity)
 {
     double x, log(), ceil();
     struct event *evptr;
     //   char *malloc();
-    float ttime;
+    simtime start;
     int tempint;
 
-    if (TRACE > 2)
+    if (S->TRACE > 2)
         printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
 
-    x = lambda * jimsrand() * 2; /* x is uniform on [0,2*lambda] */
-                                 /* having mean of lambda        */
+    if (TRAFFIC == TRACE_REPLAY && S->tracenext >= S->tracelen)
+        return; /* trace played out */
+
     evptr = (struct event *)malloc(sizeof(struct event));
-    evptr->evtime = time + x;
     evptr->evtype = FROM_LAYER5;
-    if (BIDIRECTIONAL && (jimsrand() > 0.5))
-        evptr->eventity = B;
+    if (TRAFFIC == UNIFORM && !PARALLEL)
+    {
+        x = S->lambda * jimsrand() * 2; /* x is uniform on [0,2*lambda] */
+                                     /* having mean of lambda        */
+        evptr->evtime = S->now + TICKS(x);
+        tempint = NUM_FLOWS > 1 ? (int)(jimsrand() * NUM_FLOWS) % NUM_FLOWS : 0;
+        if (BIDIRECTIONAL && (jimsrand() > 0.5))
+            evptr->eventity = ENTITY(tempint, B);
+        else
+            evptr->eventity = ENTITY(tempint, A);
+    }
+    else if (TRAFFIC == TRACE_REPLAY)
+    {
+        evptr->evtime = S->tracedata[S->tracenext].tick;
+        if (evptr->evtime < S->now)
+            evptr->evtime = S->now;
+        evptr->eventity = (int)((uint32_t)S->tracedata[S->tracenext].entity % NUM_ENTITIES); /* even if negative */
+        S->tracenext++;
+    }
     else
-        evptr->eventity = A;
+    {
+        evptr->eventity = entity;
+        if (TRAFFIC == SATURATED)
+            evptr->evtime = S->now;
+        else if (TRAFFIC == UNIFORM) /* one stream per entity when PARALLEL */
+            evptr->evtime = S->now + TICKS(S->lambda * jimsrand() * 2);
+        else
+            evptr->evtime = S->now + TICKS(exponential(S->lambda));
+        /* an ONOFF source skips over the off periods it runs into */
+        while (TRAFFIC == ONOFF && evptr->evtime > S->onuntil[entity])
+        {
+            start = S->onuntil[entity] + TICKS(exponential(S->offtime));
+            S->onuntil[entity] = start + TICKS(exponential(S->ontime));
+            evptr->evtime = start + TICKS(exponential(S->lambda));
+        }
+    }
     insertevent(evptr);
 }
 
-insertevent(struct event *p)
+/* start an empty event list and timer table, leaving the old ones to */
+/* whoever saved them                                                  */
+static void newevlist(void)
+{
+    S->evlist = NULL;
+    S->nevents = S->evlistsize = 0;
+    S->nextevseq = 0;
+    memset(S->wheel, 0, sizeof(S->wheel));
+    memset(S->wheelmap, 0, sizeof(S->wheelmap));
+    S->wheelnow = 0;
+    S->nwheel = 0;
+    S->wheelnext = NULL;
+    S->wheelstale = false;
+    S->idtimers = NULL;
+    S->freeids = NULL;
+    S->nidtimers = S->nfreeids = S->idtimersize = 0;
+}
+
+/* true if event p is to happen before event q.  Events at the same time */
+/* go newest first, as they did when the event list was a linked list.    */
+static int evbefore(struct event *p, struct event *q)
+{
+    return p->evtime < q->evtime || (p->evtime == q->evtime && p->evseq > q->evseq);
+}
+
+static void evplace(struct event *p, int i)
 {
-    struct event *q, *qold;
+    S->evlist[i] = p;
+    p->heapindex = i;
+}
+
+/* move the event at position i up or down the heap to where it belongs */
+static void evsift(int i)
+{
+    struct event *p = S->evlist[i];
+    int child;
 
-    if (TRACE > 2)
+    while (i > 0 && evbefore(p, S->evlist[(i - 1) / 2]))
     {
-        printf("            INSERTEVENT: time is %lf\n", time);
-        printf("            INSERTEVENT: future time will be %lf\n", p->evtime);
+        evplace(S->evlist[(i - 1) / 2], i);
+        i = (i - 1) / 2;
     }
-    q = evlist; /* q points to header of list in which p struct inserted */
-    if (q == NULL)
-    { /* list is empty */
-        evlist = p;
-        p->next = NULL;
-        p->prev = NULL;
+    while ((child = 2 * i + 1) < S->nevents)
+    {
+        if (child + 1 < S->nevents && evbefore(S->evlist[child + 1], S->evlist[child]))
+            child++;
+        if (!evbefore(S->evlist[child], p))
+            break;
+        evplace(S->evlist[child], i);
+        i = child;
+    }
+    evplace(p, i);
+}
+
+/* the first occupied slot at level, from slot on, or -1 if none is */
+static int wheelslot(int level, int slot)
+{
+    uint64_t bits;
+    int w;
+
+    for (w = slot / 64; w < WHEEL_SLOTS / 64; w++)
+    {
+        bits = S->wheelmap[level][w];
+        if (w == slot / 64)
+            bits &= ~0ull << (slot % 64);
+        if (bits != 0)
+            return w * 64 + __builtin_ctzll(bits);
     }
+    return -1;
+}
+
+/* put timer p on the wheel */
+static void wheeladd(struct event *p)
+{
+    uint64_t differ = (uint64_t)(p->evtime ^ S->wheelnow);
+    int level = differ ? (63 - __builtin_clzll(differ)) / WHEEL_BITS : 0;
+    int slot = (p->evtime >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+
+    p->wlevel = level;
+    p->wslot = slot;
+    p->wprev = NULL;
+    p->wnext = S->wheel[level][slot];
+    if (p->wnext != NULL)
+        p->wnext->wprev = p;
+    S->wheel[level][slot] = p;
+    S->wheelmap[level][slot / 64] |= 1ull << (slot % 64);
+    S->nwheel++;
+    if (!S->wheelstale && (S->wheelnext == NULL || evbefore(p, S->wheelnext)))
+        S->wheelnext = p;
+}
+
+/* take timer p off the wheel */
+static void wheelremove(struct event *p)
+{
+    int level = p->wlevel, slot = p->wslot;
+
+    if (p->wprev != NULL)
+        p->wprev->wnext = p->wnext;
     else
+        S->wheel[level][slot] = p->wnext;
+    if (p->wnext != NULL)
+        p->wnext->wprev = p->wprev;
+    if (S->wheel[level][slot] == NULL)
+        S->wheelmap[level][slot / 64] &= ~(1ull << (slot % 64));
+    S->nwheel--;
+    if (p == S->wheelnext)
+        S->wheelstale = true;
+}
+
+/* the earliest timer on the wheel, or NULL if there are none.  Timers */
+/* at a lower level are all earlier than those at a higher one, and    */
+/* within a level the first occupied slot holds the earliest.          */
+static struct event *wheelpeek(void)
+{
+    struct event *p;
+    int level, slot;
+
+    if (!S->wheelstale)
+        return S->wheelnext;
+    S->wheelstale = false;
+    S->wheelnext = NULL;
+    for (level = 0; level < WHEEL_LEVELS && S->nwheel > 0; level++)
     {
-        for (qold = q; q != NULL && p->evtime > q->evtime; q = q->next)
-            qold = q;
-        if (q == NULL)
-        { /* end of list */
-            qold->next = p;
-            p->prev = qold;
-            p->next = NULL;
-        }
-        else if (q == evlist)
-        { /* front of list */
-            p->next = evlist;
-            p->prev = NULL;
-            p->next->prev = p;
-            evlist = p;
-        }
-        else
-        { /* middle of list */
-            p->next = q;
-            p->prev = q->prev;
-            q->prev->next = p;
-            q->prev = p;
-        }
+        slot = wheelslot(level, (S->wheelnow >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1));
+        if (slot < 0)
+            continue;
+        for (p = S->wheel[level][slot]; p != NULL; p = p->wnext)
+            if (S->wheelnext == NULL || evbefore(p, S->wheelnext))
+                S->wheelnext = p;
+        break;
     }
+    return S->wheelnext;
 }
 
-printevlist(void)
+/* take the earliest timer p off the wheel and move the wheel on to its */
+/* time, spreading the timers that shared its slot over lower levels    */
+static void wheeladvance(struct event *p)
+{
+    struct event *q, *next;
+    int level = p->wlevel, slot = p->wslot;
+
+    wheelremove(p);
+    S->wheelnow = p->evtime;
+    if (level == 0)
+        return;
+    q = S->wheel[level][slot];
+    S->wheel[level][slot] = NULL;
+    S->wheelmap[level][slot / 64] &= ~(1ull << (slot % 64));
+    for (; q != NULL; q = next)
+    {
+        next = q->wnext;
+        S->nwheel--;
+        wheeladd(q);
+    }
+}
+
+static void insertevent(struct event *p)
+{
+    PROFILE_SITE(PROF_INSERTEVENT);
+    if (S->TRACE > 2)
+    {
+        printf("            INSERTEVENT: time is %lf\n", UNITS(S->now));
+        printf("            INSERTEVENT: future time will be %lf\n", UNITS(p->evtime));
+    }
+    p->evseq = S->nextevseq++;
+    addevent(p);
+}
+
+/* put event p, whose evseq is already set, into the event list */
+static void addevent(struct event *p)
+{
+    if (TIMER_WHEEL && p->evtype == TIMER_INTERRUPT)
+    {
+        wheeladd(p);
+        return;
+    }
+    if (S->nevents == S->evlistsize)
+    {
+        S->evlistsize = S->evlistsize ? 2 * S->evlistsize : 64;
+        S->evlist = (struct event **)realloc(S->evlist, S->evlistsize * sizeof(struct event *));
+    }
+    evplace(p, S->nevents++);
+    evsift(p->heapindex);
+}
+
+/* take event p out of the event list */
+static void removeevent(struct event *p)
+{
+    int i = p->heapindex;
+
+    if (TIMER_WHEEL && p->evtype == TIMER_INTERRUPT)
+    {
+        wheelremove(p);
+        return;
+    }
+    S->nevents--;
+    if (i < S->nevents)
+    {
+        evplace(S->evlist[S->nevents], i);
+        evsift(i);
+    }
+}
+
+/* remove and return the earliest event, or NULL if there are none */
+static struct event *nextevent(void)
+{
+    struct event *p = peekevent();
+
+    if (p == NULL)
+        return NULL;
+    if (TIMER_WHEEL && p->evtype == TIMER_INTERRUPT)
+        wheeladvance(p);
+    else
+        removeevent(p);
+    return p;
+}
+
+/* the earliest event, left where it is, or NULL if there are none */
+static struct event *peekevent(void)
+{
+    struct event *q = TIMER_WHEEL ? wheelpeek() : NULL;
+
+    if (S->nevents > 0 && (q == NULL || evbefore(S->evlist[0], q)))
+        return S->evlist[0];
+    return q;
+}
+
+static void printevlist(void)
 {
-    struct event *q;
     int i;
-    printf("--------------\nEvent List Follows:\n");
-    for (q = evlist; q != NULL; q = q->next)
+    printf("--------------\nEvent List Follows (heap order):\n");
+    for (i = 0; i < S->nevents; i++)
     {
-        printf("Event time: %f, type: %d entity: %d\n", q->evtime, q->evtype, q->eventity);
+        printf("Event time: %f, type: %d entity: %d\n", UNITS(S->evlist[i]->evtime), S->evlist[i]->evtype, S->evlist[i]->eventity);
     }
+    if (S->nwheel > 0)
+        printf("and %d timers on the timing wheel\n", S->nwheel);
     printf("--------------\n");
 }
 
 /********************** Student-callable ROUTINES ***********************/
 
 /* called by students routine to cancel a previously-started timer */
-void stoptimer(int AorB) /* A or B is trying to stop timer */
-{
-    struct event *q, *qold;
-
-    if (TRACE > 2)
-        printf("          STOP TIMER: stopping timer at %f\n", time);
-    /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-    for (q = evlist; q != NULL; q = q->next)
-        if ((q->evtype == TIMER_INTERRUPT && q->eventity == AorB))
-        {
-            /* remove this event */
-            if (q->next == NULL && q->prev == NULL)
-                evlist = NULL;        /* remove first and only event on list */
-            else if (q->next == NULL) /* end of list - there is one in front */
-                q->prev->next = NULL;
-            else if (q == evlist)
-            { /* front of list - there must be event after */
-                q->next->prev = NULL;
-                evlist = q->next;
-            }
-            else
-            { /* middle of list */
-                q->next->prev = q->prev;
-                q->prev->next = q->next;
-            }
-            free(q);
-            return;
-        }
-    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+static void stoptimer(int AorB) /* A or B is trying to stop timer */
+{
+    PROFILE_SITE(PROF_STOPTIMER);
+    struct event *q;
+
+    if (S->TRACE > 2)
+        printf("          STOP TIMER: stopping timer at %f\n", UNITS(NOW));
+    if (SOCKETS)
+    {
+        armtimer(AorB, 0.0);
+        return;
+    }
+    if (THREADS)
+    {
+        threadtimer(AorB, 0.0);
+        return;
+    }
+    q = S->timerevent[AorB];
+    if (q == NULL)
+    {
+        printf("Warning: unable to cancel your timer. It wasn't running.\n");
+        return;
+    }
+    removeevent(q);
+    free(q);
+    S->timerevent[AorB] = NULL;
 }
 
-void starttimer(int AorB, float increment) /* A or B is trying to start timer */
+static void starttimer(int AorB, float increment) /* A or B is trying to start timer */
 {
+    PROFILE_SITE(PROF_STARTTIMER);
 
-    struct event *q;
     struct event *evptr;
     // char *malloc();
 
-    if (TRACE > 2)
-        printf("          START TIMER: starting timer at %f\n", time);
+    if (S->TRACE > 2)
+        printf("          START TIMER: starting timer at %f\n", UNITS(NOW));
+    if (SOCKETS)
+    {
+        armtimer(AorB, increment);
+        return;
+    }
+    if (THREADS)
+    {
+        threadtimer(AorB, increment);
+        return;
+    }
     /* be nice: check to see if timer is already started, if so, then  warn */
-    /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-    for (q = evlist; q != NULL; q = q->next)
-        if ((q->evtype == TIMER_INTERRUPT && q->eventity == AorB))
-        {
-            printf("Warning: attempt to start a timer that is already started\n");
-            return;
-        }
+    if (S->timerevent[AorB] != NULL)
+    {
+        printf("Warning: attempt to start a timer that is already started\n");
+        return;
+    }
 
     /* create future event for when timer goes off */
     evptr = (struct event *)malloc(sizeof(struct event));
-    evptr->evtime = time + increment;
+    evptr->evtime = S->now + TICKS(increment);
+    evptr->evtype = TIMER_INTERRUPT;
+    evptr->eventity = AorB;
+    evptr->timerid = -1;
+    insertevent(evptr);
+    S->timerevent[AorB] = evptr;
+}
+
+/* make room for twice as many timer ids */
+static void growtimers(void)
+{
+    S->idtimersize = S->idtimersize ? 2 * S->idtimersize : 64;
+    S->idtimers = (struct event **)realloc(S->idtimers, S->idtimersize * sizeof(struct event *));
+    S->freeids = (int *)realloc(S->freeids, S->idtimersize * sizeof(int));
+}
+
+/* the timer with this id has gone off or been cancelled */
+static void releasetimer(int id)
+{
+    S->idtimers[id] = NULL;
+    S->freeids[S->nfreeids++] = id;
+}
+
+/* start another timer for AorB, one of as many as it likes, and return */
+/* its id.  When it goes off the timer interrupt gets the id from        */
+/* firedtimer(); for the timer started with starttimer() that is -1.     */
+static int settimer(int AorB, float increment)
+{
+    struct event *evptr;
+    int id;
+
+    if (SOCKETS || THREADS)
+    {
+        printf("settimer() is not available with SOCKETS or THREADS\n");
+        exit(1);
+    }
+    if (S->nfreeids > 0)
+        id = S->freeids[--S->nfreeids];
+    else
+    {
+        if (S->nidtimers == S->idtimersize)
+            growtimers();
+        id = S->nidtimers++;
+    }
+    evptr = (struct event *)malloc(sizeof(struct event));
+    evptr->evtime = S->now + TICKS(increment);
     evptr->evtype = TIMER_INTERRUPT;
     evptr->eventity = AorB;
+    evptr->timerid = id;
     insertevent(evptr);
+    S->idtimers[id] = evptr;
+    return id;
+}
+
+/* id of the timer being delivered, or -1 */
+static int firedtimer(void)
+{
+    return S->firedtimer;
+}
+
+/* cancel the timer settimer() returned id for */
+static void canceltimer(int id)
+{
+    if (id < 0 || id >= S->nidtimers || S->idtimers[id] == NULL)
+    {
+        printf("Warning: unable to cancel timer %d. It wasn't running.\n", id);
+        return;
+    }
+    removeevent(S->idtimers[id]);
+    free(S->idtimers[id]);
+    releasetimer(id);
 }
 
 /************************** TOLAYER3 ***************/
-void tolayer3(int AorB, struct pkt packet) /* A or B is trying to stop timer */
+
+/* queue a packet on the bottleneck link leaving AorB's side.  Returns */
+/* the time its last byte leaves the link, or -1 if the queue is full. */
+static simtime linkenqueue(int AorB)
+{
+    int side = AorB % 2;
+    int ring = MAX_QUEUE_CAPACITY + 1;
+    simtime start;
+
+    /* forget packets that finished transmission before now */
+    while (S->queuelen[side] > 0 && S->queuedepart[side][S->queuehead[side]] <= S->now)
+    {
+        S->queuehead[side] = (S->queuehead[side] + 1) % ring;
+        S->queuelen[side]--;
+    }
+    if (S->queuelen[side] > S->queuecap) /* buffer full and one in service */
+        return -1;
+
+    start = S->linkfree[side] > S->now ? S->linkfree[side] : S->now;
+    S->linkfree[side] = start + TICKS(sizeof(struct pkt) / S->linkrate);
+    S->queuedepart[side][(S->queuehead[side] + S->queuelen[side]) % ring] = S->linkfree[side];
+    S->queuelen[side]++;
+    return S->linkfree[side];
+}
+
+/* simulate corruption of a packet leaving AorB's side: */
+/* checksum number alg of what a checksum covers in p: the header fields */
+/* besides checksum, then the payload                                     */
+static uint32_t checksumof(int alg, struct pkt *p)
+{
+    unsigned char b[3 * sizeof(int) + PAYLOAD_SIZE];
+    uint32_t sum = 0, s1 = 0, s2 = 0;
+    int n = 0, i, k;
+
+    memcpy(b + n, &p->seqnum, sizeof(int)), n += sizeof(int);
+    memcpy(b + n, &p->acknum, sizeof(int)), n += sizeof(int);
+    memcpy(b + n, &p->window, sizeof(int)), n += sizeof(int);
+    memcpy(b + n, p->payload, PAYLOAD_SIZE), n += PAYLOAD_SIZE;
+    switch (alg)
+    {
+    case 0: /* the protocol's own additive sum */
+        return calculateChecksum(*p);
+    case 1: /* RFC 1071 ones' complement sum of 16-bit words */
+        for (i = 0; i < n; i += 2)
+            sum += b[i] << 8 | (i + 1 < n ? b[i + 1] : 0);
+        while (sum >> 16)
+            sum = (sum & 0xffff) + (sum >> 16);
+        return ~sum & 0xffff;
+    case 2: /* Fletcher-16 */
+        for (i = 0; i < n; i++)
+        {
+            s1 = (s1 + b[i]) % 255;
+            s2 = (s2 + s1) % 255;
+        }
+        return s2 << 8 | s1;
+    default: /* CRC-32, bit at a time as it is only needed for corrupted packets */
+        sum = 0xffffffff;
+        for (i = 0; i < n; i++)
+            for (sum ^= b[i], k = 0; k < 8; k++)
+                sum = sum >> 1 ^ (0xedb88320 & -(sum & 1));
+        return ~sum;
+    }
+}
+
+/* flip the bits of p the bit error rate hits.  tobit counts down the   */
+/* bits until the next flip, so a packet it passes costs a subtraction. */
+/* A checksum misses the flips when it comes out the same for the      */
+/* corrupted fields as for the original ones with the checksum field's  */
+/* flips applied.                                                       */
+static void flipbits(int AorB, struct pkt *p)
+{
+    struct gechannel *ch = &S->channel[AorB % 2];
+    struct pkt orig;
+    uint32_t error;
+    int alg;
+
+    if (ch->tobit >= PKT_BITS)
+    {
+        ch->tobit -= PKT_BITS;
+        return;
+    }
+    orig = *p;
+    for (; ch->tobit < PKT_BITS; ch->tobit += geometricskip(S->ber))
+    {
+        ((unsigned char *)p)[ch->tobit / 8] ^= 1 << ch->tobit % 8;
+        S->nflipped++;
+    }
+    ch->tobit -= PKT_BITS;
+    S->ncorrupt++;
+    error = p->checksum ^ orig.checksum;
+    for (alg = 0; alg < NUM_CHECKSUMS; alg++)
+        if (checksumof(alg, p) == (checksumof(alg, &orig) ^ error))
+            S->nescaped[alg]++;
+    if (S->TRACE > 0)
+        printf("          TOLAYER3: packet being corrupted\n");
+}
+
+static void printescapes(void)
+{
+    int alg;
+
+    printf(" %ld packets corrupted by %ld bit flips at a bit error rate of %g; checksums would have missed\n",
+           S->ncorrupt, S->nflipped, S->ber);
+    for (alg = 0; alg < NUM_CHECKSUMS; alg++)
+        printf("   %-12s %ld (%g of corrupted packets)\n", checksumname[alg], S->nescaped[alg],
+               S->ncorrupt > 0 ? (double)S->nescaped[alg] / S->ncorrupt : 0.0);
+}
+
+static void corruptpacket(int AorB, struct pkt *mypktptr)
+{
+    float x, jimsrand();
+
+    if (CHANNEL_MODEL == BIT_ERRORS)
+        flipbits(AorB, mypktptr);
+    else if (channelcorrupts(AorB))
+    {
+        S->ncorrupt++;
+        if ((x = jimsrand()) < .75)
+            mypktptr->payload[0] = 'Z'; /* corrupt payload */
+        else if (x < .875)
+            mypktptr->seqnum = 999999;
+        else
+            mypktptr->acknum = 999999;
+        if (S->TRACE > 0)
+            printf("          TOLAYER3: packet being corrupted\n");
+    }
+}
+
+static void tolayer3(int AorB, struct pkt packet) /* A or B is trying to stop timer */
 {
+    PROFILE_SITE(PROF_TOLAYER3);
     struct pkt *mypktptr;
-    struct event *evptr, *q;
+    struct event *evptr;
     // char *malloc();
-    float lastime, x, jimsrand();
+    simtime lastime, departtime;
+    float jimsrand();
     int i;
 
-    ntolayer3++;
+    if (THREADS && !inmedium) /* the medium thread does the rest */
+    {
+        if (!ringput(&S->tomedium[AorB % 2], AorB, &packet, threadtime))
+            S->nringdrop[AorB % 2]++;
+        return;
+    }
+    S->ntolayer3++;
+
+    /* simulate overflow of the bottleneck queue: */
+    if (LINK_MODEL && (departtime = linkenqueue(AorB)) < 0)
+    {
+        S->nqueuedrop++;
+        if (S->TRACE > 0)
+            printf("          TOLAYER3: bottleneck queue full, packet dropped\n");
+        return;
+    }
 
     /* simulate losses: */
-    if (jimsrand() < lossprob)
+    if (channelloses(AorB))
     {
-        nlost++;
-        if (TRACE > 0)
+        S->nlost++;
+        if (S->TRACE > 0)
             printf("          TOLAYER3: packet being lost\n");
         return;
     }
@@ -631,56 +5168,162 @@ void tolayer3(int AorB, struct pkt packet) /* A or B is trying to stop timer */
     mypktptr->seqnum = packet.seqnum;
     mypktptr->acknum = packet.acknum;
     mypktptr->checksum = packet.checksum;
-    for (i = 0; i < 20; i++)
+    mypktptr->window = packet.window;
+    for (i = 0; i < PAYLOAD_SIZE; i++)
         mypktptr->payload[i] = packet.payload[i];
-    if (TRACE > 2)
+    if (S->TRACE > 2)
     {
         printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
                mypktptr->acknum, mypktptr->checksum);
-        for (i = 0; i < 20; i++)
+        for (i = 0; i < PAYLOAD_SIZE; i++)
             printf("%c", mypktptr->payload[i]);
         printf("\n");
     }
 
+    if (SOCKETS) /* corrupt it here and let the kernel deliver it */
+    {
+        corruptpacket(AorB, mypktptr);
+        socketsend(AorB, mypktptr);
+        free(mypktptr);
+        return;
+    }
+
     /* create future event for arrival of packet at the other side */
     evptr = (struct event *)malloc(sizeof(struct event));
     evptr->evtype = FROM_LAYER3;      /* packet will pop out from layer3 */
-    evptr->eventity = (AorB + 1) % 2; /* event occurs at other entity */
+    evptr->eventity = AorB ^ 1;       /* event occurs at other entity */
     evptr->pktptr = mypktptr;         /* save ptr to my copy of packet */
-                                      /* finally, compute the arrival time of packet at the other end.
-   medium can not reorder, so make sure packet arrives between 1 and 10
-   time units after the latest arrival time of packets
-   currently in the medium on their way to the destination */
-    lastime = time;
-    /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-    for (q = evlist; q != NULL; q = q->next)
-        if ((q->evtype == FROM_LAYER3 && q->eventity == evptr->eventity))
-            lastime = q->evtime;
-    evptr->evtime = lastime + 1 + 9 * jimsrand();
-
-    /* simulate corruption: */
-    if (jimsrand() < corruptprob)
-    {
-        ncorrupt++;
-        if ((x = jimsrand()) < .75)
-            mypktptr->payload[0] = 'Z'; /* corrupt payload */
-        else if (x < .875)
-            mypktptr->seqnum = 999999;
-        else
-            mypktptr->acknum = 999999;
-        if (TRACE > 0)
-            printf("          TOLAYER3: packet being corrupted\n");
+    evptr->order = S->sendorder[AorB]++;
+    /* finally, compute the arrival time of packet at the other end.      */
+    /* An in-order medium makes sure the packet arrives no earlier than   */
+    /* the latest packet currently in the medium on its way to the        */
+    /* destination: between 1 and 10 time units after it, or just after   */
+    /* it once it clears the bottleneck link.                             */
+    if (LINK_MODEL)
+    {
+        /* serialization and queueing are in departtime */
+        evptr->evtime = departtime + TICKS(S->propdelay + S->jitter * jimsrand());
+        if (CHANNEL_ORDER != INDEPENDENT_DELAY && evptr->evtime < S->lastarrival[AorB])
+            evptr->evtime = S->lastarrival[AorB];
+    }
+    else
+    {
+        lastime = S->now;
+        if (CHANNEL_ORDER != INDEPENDENT_DELAY && S->lastarrival[AorB] > lastime)
+            lastime = S->lastarrival[AorB];
+        evptr->evtime = lastime + TICKS(1 + 9 * jimsrand());
     }
+    if (CHANNEL_ORDER == REORDER && jimsrand() < S->reorderprob)
+        evptr->evtime = evptr->evtime + TICKS(S->reorderdelay * jimsrand()); /* held back */
+    else
+        S->lastarrival[AorB] = evptr->evtime;
+    if (THREADS) /* for threadtimer() */
+        __atomic_store_n(&S->sidetransit[AorB % 2],
+                         S->sidetransit[AorB % 2] + (evptr->evtime - S->now - S->sidetransit[AorB % 2]) / 8,
+                         __ATOMIC_RELAXED);
+
+    corruptpacket(AorB, mypktptr);
 
-    if (TRACE > 2)
+    if (S->TRACE > 2)
         printf("          TOLAYER3: scheduling arrival on other side\n");
-    insertevent(evptr);
+    if (PARALLEL && flowendpoint(evptr->eventity) != S->partition)
+        mailsend(evptr);
+    else
+    {
+        S->ninflight++;
+        insertevent(evptr);
+    }
 }
 
-void tolayer5(int AorB, char datasent[20])
+static void tolayer5(int AorB, char datasent[PAYLOAD_SIZE])
 {
+    int i, n;
+
+    if (!COALESCE)
+    {
+        delivermsg(AorB, datasent);
+        return;
+    }
+    n = datasent[0] - '0';
+    for (i = 0; i < n && i < COALESCE_MAX; i++)
+        delivermsg(AorB, datasent + 1 + i * MSG_SIZE);
+}
+
+/* *sum += x, when another thread may be adding to it too */
+static void atomicadd(double *sum, double x)
+{
+    double old, new;
+
+    __atomic_load(sum, &old, __ATOMIC_RELAXED);
+    do
+        new = old + x;
+    while (!__atomic_compare_exchange(sum, &old, &new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* pass one message up to layer 5 at AorB */
+static void delivermsg(int AorB, char datasent[20])
+{
+    if (FLOW_CONTROL)
+    {
+        if (layer5room(AorB) <= 0)
+        {
+            S->nrcvoverflow++;
+            if (S->TRACE > 0)
+                printf("          TOLAYER5: receive buffer full, msg lost\n");
+            return;
+        }
+        S->rcvfill[AorB] += 1.0;
+    }
+    struct observation *o = STEADY_STATE ? interval(S->now / S->obsticks) : NULL;
+    long seq;
+    unsigned n, m;
+    double delay;
     int i;
-    if (TRACE > 2)
+
+    S->ndelivered[AorB]++;
+    if (TRAFFIC == SATURATED && !THREADS)
+        S->lastdelivery = S->now;
+    if (STEADY_STATE)
+        o->delivered++;
+    if (FILE_TRANSFER)
+        filereceive(AorB, datasent);
+    else if (VERIFY)
+        verifymsg(AorB, datasent);
+    if (TIMED && !FILE_TRANSFER && !PARALLEL && (seq = hexfield(datasent + 12, 8)) >= 0 &&
+        (n = (unsigned)seq) < (unsigned)(m = __atomic_load_n(&S->nsim, __ATOMIC_RELAXED)))
+    {
+        if (m - n > GENRING) /* its generation time is overwritten */
+        {
+            if (THREADS)
+                __atomic_fetch_add(&S->nuntimed, 1, __ATOMIC_RELAXED);
+            else
+                S->nuntimed++;
+        }
+        else
+        {
+            delay = UNITS(NOW - S->gentime[n % GENRING]);
+            if (THREADS) /* the other side may be delivering too */
+            {
+                atomicadd(&S->latencysum, delay);
+                __atomic_fetch_add(&S->nlatency, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&S->latencyhist[latencybucket(NOW - S->gentime[n % GENRING])], 1, __ATOMIC_RELAXED);
+            }
+            else
+            {
+                S->latencysum += delay;
+                S->nlatency++;
+                S->latencyhist[latencybucket(S->now - S->gentime[n % GENRING])]++;
+                if (S->now - S->gentime[n % GENRING] > S->latencymax)
+                    S->latencymax = S->now - S->gentime[n % GENRING];
+            }
+            if (STEADY_STATE)
+            {
+                o->latencysum += delay;
+                o->nlatency++;
+            }
+        }
+    }
+    if (S->TRACE > 2)
     {
         printf("          TOLAYER5: data received: ");
         for (i = 0; i < 20; i++)
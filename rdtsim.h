@@ -0,0 +1,52 @@
+/* rdtsim.h: the simulators built as a library (SIM_LIBRARY 1), so a     */
+/* program can run many configurations without starting one process per */
+/* run.  goBackN.c and alternating.c each implement it; link one.        */
+/* Each sim keeps all its state to itself, so different threads can run  */
+/* different sims at once; only one thread may use a sim at a time.      */
+#ifndef RDTSIM_H
+#define RDTSIM_H
+
+struct simconfig /* what the simulator otherwise asks for at start-up */
+{
+    int nsimmax;       /* messages to simulate */
+    float lossprob;    /* packet loss probability */
+    float corruptprob; /* packet corruption probability */
+    float lambda;      /* average time between messages from layer 5 */
+    int trace;         /* TRACE */
+    int seed;          /* random number seed */
+    int quiet;         /* nonzero to print nothing, not even the trace */
+    float timeout;     /* retransmission timeout, 0 for the protocol's own */
+};
+
+struct simstats /* where a sim has got to */
+{
+    double time;            /* simulated time */
+    long events;            /* events simulated */
+    int generated;          /* messages generated at layer 5 */
+    long delivered;         /* messages delivered to layer 5 */
+    long sent, lost, corrupted; /* packets */
+    double goodput;         /* msgs delivered per time unit */
+    double latencymedian, latencyp99;
+    int done;               /* all nsimmax messages have been generated */
+};
+
+struct sim;
+
+/* a sim at time 0, or NULL if the simulator was built with a feature    */
+/* struct simconfig doesn't cover: SOCKETS, THREADS, PARALLEL, SNAPSHOT, */
+/* METRICS, SAMPLER, STEADY_STATE, DRAIN, FILE_TRANSFER, LINK_MODEL,     */
+/* COALESCE, FLOW_CONTROL or PROFILE, a CHANNEL_MODEL other than         */
+/* BERNOULLI, CHANNEL_ORDER REORDER, or TRAFFIC ONOFF or TRACE_REPLAY.   */
+/* Any other build is supported, FEC included; a sim is one run, even    */
+/* with REPLICATIONS.                                                    */
+struct sim *sim_create(struct simconfig *config);
+
+/* simulate up to nevents more events; returns how many it did, */
+/* fewer once the run is over                                    */
+long sim_run(struct sim *sim, long nevents);
+
+struct simstats sim_stats(struct sim *sim);
+
+void sim_destroy(struct sim *sim);
+
+#endif